@@ -0,0 +1,394 @@
+#include "calibrate.h"
+
+#include <libavutil/cpu.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CALIBRATION_FRAMES 32
+#define BLEND_ROUNDS 4
+/* enough frames that filling the codecs' frame threads doesn't dominate */
+#define CODEC_FRAMES 240
+#define CALIBRATION_DELAY 2
+
+void default_profile(struct profile *p) {
+        p->width = 0;
+        p->height = 0;
+        p->codec_id = AV_CODEC_ID_NONE;
+        p->blend_kernel = BLEND_SCALAR;
+        p->blend_threads = 1;
+        p->codec_threads = 0;
+}
+
+/* $XDG_CONFIG_HOME/moex/<hostname>-<width>x<height>-<codec>.profile,
+ * falling back to ~/.config */
+char *profile_path(int width, int height, enum AVCodecID codec_id) {
+        char host[256] = "localhost";
+        gethostname(host, sizeof(host) - 1);
+        host[sizeof(host) - 1] = '\0';
+
+        const char *config = getenv("XDG_CONFIG_HOME");
+        const char *suffix = "";
+        if (config == NULL || config[0] == '\0') {
+                config = getenv("HOME");
+                suffix = "/.config";
+                if (config == NULL) {
+                        return NULL;
+                }
+        }
+
+        const char *codec = avcodec_get_name(codec_id);
+        size_t len = strlen(config) + strlen(suffix) + strlen(host) +
+                     strlen(codec) + 64;
+        char *path = malloc(len);
+        if (path == NULL) {
+                return NULL;
+        }
+        snprintf(path, len, "%s%s/moex/%s-%dx%d-%s.profile", config, suffix,
+                 host, width, height, codec);
+
+        return path;
+}
+
+int load_profile(const char *path, struct profile *p) {
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+                return AVERROR(errno);
+        }
+
+        char line[256];
+        char value[64];
+        while (fgets(line, sizeof(line), f) != NULL) {
+                if (sscanf(line, "width=%d", &p->width) == 1 ||
+                    sscanf(line, "height=%d", &p->height) == 1 ||
+                    sscanf(line, "blend_threads=%d", &p->blend_threads) == 1 ||
+                    sscanf(line, "codec_threads=%d", &p->codec_threads) == 1) {
+                        continue;
+                }
+                if (sscanf(line, "codec=%63s", value) == 1) {
+                        const AVCodecDescriptor *desc =
+                            avcodec_descriptor_get_by_name(value);
+                        p->codec_id = desc ? desc->id : AV_CODEC_ID_NONE;
+                        continue;
+                }
+                if (sscanf(line, "blend_kernel=%63s", value) == 1) {
+                        for (int k = 0; k < NB_BLEND_KERNELS; k++) {
+                                if (strcmp(value, blend_kernel_names[k]) == 0) {
+                                        p->blend_kernel = k;
+                                }
+                        }
+                }
+        }
+        fclose(f);
+
+        if (p->blend_threads < 1) {
+                p->blend_threads = 1;
+        }
+        if (p->codec_threads < 0) {
+                p->codec_threads = 0;
+        }
+
+        return 0;
+}
+
+/* Creates the directories leading up to path */
+static void make_parents(const char *path) {
+        char *dir = strdup(path);
+        if (dir == NULL) {
+                return;
+        }
+        for (char *c = dir + 1; *c != '\0'; c++) {
+                if (*c == '/') {
+                        *c = '\0';
+                        mkdir(dir, 0755);
+                        *c = '/';
+                }
+        }
+        free(dir);
+}
+
+int save_profile(const char *path, const struct profile *p) {
+        make_parents(path);
+
+        FILE *f = fopen(path, "w");
+        if (f == NULL) {
+                fprintf(stderr, "ERROR:   Could not open profile '%s'\n", path);
+                return AVERROR(errno);
+        }
+
+        fprintf(f,
+                "# moex calibration profile, written by --calibrate\n"
+                "width=%d\n"
+                "height=%d\n"
+                "codec=%s\n"
+                "blend_kernel=%s\n"
+                "blend_threads=%d\n"
+                "codec_threads=%d\n",
+                p->width, p->height, avcodec_get_name(p->codec_id),
+                blend_kernel_names[p->blend_kernel],
+                p->blend_threads, p->codec_threads);
+
+        if (fclose(f) != 0) {
+                fprintf(stderr, "ERROR:   Failed to write profile '%s'\n",
+                        path);
+                return AVERROR(EIO);
+        }
+
+        return 0;
+}
+
+/* A gradient with a box moving across it, so consecutive frames differ the
+ * way real footage does */
+static AVFrame *synthetic_frame(int width, int height, int n) {
+        AVFrame *frame = av_frame_alloc();
+        if (frame == NULL) {
+                return NULL;
+        }
+
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = width;
+        frame->height = height;
+        if (av_frame_get_buffer(frame, 0) < 0) {
+                av_frame_free(&frame);
+                return NULL;
+        }
+
+        int box = width / 8;
+        int bx = (n * 16) % (width - box > 0 ? width - box : 1);
+        for (int y = 0; y < height; y++) {
+                uint8_t *row = frame->data[0] + y * frame->linesize[0];
+                for (int x = 0; x < width; x++) {
+                        int inside = x >= bx && x < bx + box && y >= box &&
+                                     y < 2 * box;
+                        row[x] = inside ? 235 : (x + y + n) & 0xff;
+                }
+        }
+        for (int p = 1; p < 3; p++) {
+                for (int y = 0; y < height / 2; y++) {
+                        memset(frame->data[p] + y * frame->linesize[p],
+                               128 + (p == 1 ? n : -n) % 64, width / 2);
+                }
+        }
+        frame->pts = n;
+
+        return frame;
+}
+
+/* Returns the time in microseconds, or a negative error */
+static int64_t time_blend(AVFrame **frames, enum blend_kernel kernel,
+                          int nb_threads) {
+        struct blender *b = init_blender(kernel, nb_threads);
+        struct frame_queue *q = init_queue(CALIBRATION_DELAY);
+        if (b == NULL || q == NULL) {
+                free_blender(&b);
+                if (q != NULL)
+                        free_queue(q);
+                return AVERROR(ENOMEM);
+        }
+
+        int64_t ret = 0;
+        int64_t start = av_gettime_relative();
+        for (int r = 0; r < BLEND_ROUNDS && ret == 0; r++) {
+                for (int i = 0; i < CALIBRATION_FRAMES; i++) {
+                        AVFrame *cur = deep_copy_frame(frames[i]);
+                        if (cur == NULL) {
+                                ret = AVERROR(ENOMEM);
+                                break;
+                        }
+                        AVFrame *out = overlay_frames_yuv420p(&cur, q, NULL, b);
+                        if (out == NULL) {
+                                av_frame_free(&cur);
+                                ret = AVERROR(ENOMEM);
+                                break;
+                        }
+                        av_frame_free(&out);
+                }
+        }
+        if (ret == 0) {
+                ret = av_gettime_relative() - start;
+        }
+
+        free_queue(q);
+        free_blender(&b);
+        return ret;
+}
+
+static int open_codec(AVCodecContext **ctx, const AVCodec *codec, int width,
+                      int height, int threads) {
+        (*ctx) = avcodec_alloc_context3(codec);
+        if ((*ctx) == NULL) {
+                return AVERROR(ENOMEM);
+        }
+
+        (*ctx)->width = width;
+        (*ctx)->height = height;
+        (*ctx)->pix_fmt = AV_PIX_FMT_YUV420P;
+        (*ctx)->time_base = (AVRational){1, 25};
+        (*ctx)->thread_count = threads;
+
+        return avcodec_open2((*ctx), codec, NULL);
+}
+
+/* Decodes one packet, or flushes the decoder for NULL. If the decoder
+ * can't take the packet yet, its frames are drained and it's sent again so
+ * every encoded packet gets decoded. */
+static int decode_packet(AVCodecContext *dec, const AVPacket *packet,
+                         AVFrame *frame) {
+        while (1) {
+                int ret = avcodec_send_packet(dec, packet);
+                int sent = ret != AVERROR(EAGAIN);
+                if (ret < 0 && sent) {
+                        return ret;
+                }
+
+                while ((ret = avcodec_receive_frame(dec, frame)) >= 0) {
+                        av_frame_unref(frame);
+                }
+                if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+                        return ret;
+                }
+                if (sent) {
+                        return 0;
+                }
+        }
+}
+
+/* Encodes the frames and decodes the result again with the given number of
+ * codec threads. Returns the time in microseconds, or a negative error. */
+static int64_t time_codec(AVFrame **frames, enum AVCodecID codec_id,
+                          int threads) {
+        const AVCodec *encoder = avcodec_find_encoder(codec_id);
+        const AVCodec *decoder = avcodec_find_decoder(codec_id);
+        if (encoder == NULL || decoder == NULL) {
+                return AVERROR_ENCODER_NOT_FOUND;
+        }
+
+        AVCodecContext *enc = NULL;
+        AVCodecContext *dec = NULL;
+        AVPacket *packet = av_packet_alloc();
+        AVFrame *frame = av_frame_alloc();
+        int64_t ret = packet && frame ? 0 : AVERROR(ENOMEM);
+
+        if (ret == 0)
+                ret = open_codec(&enc, encoder, frames[0]->width,
+                                 frames[0]->height, threads);
+        if (ret == 0)
+                ret = open_codec(&dec, decoder, frames[0]->width,
+                                 frames[0]->height, threads);
+
+        // opening the codecs and starting their threads isn't timed
+        int64_t start = av_gettime_relative();
+        for (int i = 0; i <= CODEC_FRAMES && ret >= 0; i++) {
+                // the frames are used over and over, NULL after the last
+                // one flushes the encoder
+                AVFrame *input = NULL;
+                if (i < CODEC_FRAMES) {
+                        input = frames[i % CALIBRATION_FRAMES];
+                        input->pts = i;
+                }
+                ret = avcodec_send_frame(enc, input);
+                while (ret >= 0) {
+                        ret = avcodec_receive_packet(enc, packet);
+                        if (ret < 0) {
+                                break;
+                        }
+                        ret = decode_packet(dec, packet, frame);
+                        av_packet_unref(packet);
+                }
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                        ret = 0;
+                }
+        }
+
+        if (ret >= 0) {
+                ret = decode_packet(dec, NULL, frame);
+        }
+        if (ret >= 0) {
+                ret = av_gettime_relative() - start;
+        }
+
+        avcodec_free_context(&enc);
+        avcodec_free_context(&dec);
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        return ret;
+}
+
+/* Thread counts to try: powers of two, then the core count itself when it
+ * isn't one */
+static int next_threads(int threads, int cpus) {
+        if (threads == cpus) {
+                return cpus + 1;
+        }
+        return FFMIN(threads * 2, cpus);
+}
+
+/* Benchmarks every blend kernel and thread count on synthetic frames of the
+ * given size and stores the fastest combination in p. */
+int calibrate(struct profile *p, int width, int height,
+              enum AVCodecID codec_id) {
+        AVFrame *frames[CALIBRATION_FRAMES] = {0};
+        int ret = 0;
+
+        for (int i = 0; i < CALIBRATION_FRAMES; i++) {
+                frames[i] = synthetic_frame(width, height, i);
+                if (frames[i] == NULL) {
+                        fprintf(stderr, "ERROR:   Couldn't allocate frames\n");
+                        ret = AVERROR(ENOMEM);
+                        goto cleanup;
+                }
+        }
+
+        default_profile(p);
+        p->width = width;
+        p->height = height;
+        p->codec_id = codec_id;
+
+        int cpus = av_cpu_count();
+        int64_t best = INT64_MAX;
+
+        printf("Blend kernels (%dx%d, %d frames):\n", width, height,
+               CALIBRATION_FRAMES * BLEND_ROUNDS);
+        for (int k = 0; k < NB_BLEND_KERNELS; k++) {
+                for (int t = 1; t <= cpus; t = next_threads(t, cpus)) {
+                        int64_t us = time_blend(frames, k, t);
+                        if (us < 0) {
+                                ret = us;
+                                goto cleanup;
+                        }
+                        printf("   %-8s %3d threads  %8.2f ms/frame\n",
+                               blend_kernel_names[k], t,
+                               us / 1000.0 / (CALIBRATION_FRAMES * BLEND_ROUNDS));
+                        if (us < best) {
+                                best = us;
+                                p->blend_kernel = k;
+                                p->blend_threads = t;
+                        }
+                }
+        }
+
+        printf("Codec threads (%s):\n", avcodec_get_name(codec_id));
+        best = INT64_MAX;
+        for (int t = 1; t <= cpus; t = next_threads(t, cpus)) {
+                int64_t us = time_codec(frames, codec_id, t);
+                if (us < 0) {
+                        printf("\033[93mWarning! \033[0mCouldn't benchmark the "
+                               "codec, leaving codec threads at the default\n");
+                        p->codec_threads = 0;
+                        break;
+                }
+                printf("   %3d threads  %8.2f ms/frame\n", t,
+                       us / 1000.0 / CODEC_FRAMES);
+                if (us < best) {
+                        best = us;
+                        p->codec_threads = t;
+                }
+        }
+
+cleanup:
+        for (int i = 0; i < CALIBRATION_FRAMES; i++) {
+                av_frame_free(&frames[i]);
+        }
+        return ret;
+}
@@ -0,0 +1,34 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+#include <libavcodec/avcodec.h>
+
+#include "extraction.h"
+
+/*
+ * Per-host tuning saved by --calibrate and picked up by later runs on
+ * input of the same resolution and codec. codec_threads of 0 means no
+ * value was calibrated: thread_count is left alone, so libavcodec keeps
+ * its default of a single thread rather than auto-detecting.
+ */
+struct profile {
+        int width;
+        int height;
+        enum AVCodecID codec_id;
+        enum blend_kernel blend_kernel;
+        int blend_threads;
+        int codec_threads;
+};
+
+void default_profile(struct profile *p);
+
+char *profile_path(int width, int height, enum AVCodecID codec_id);
+
+int load_profile(const char *path, struct profile *p);
+
+int save_profile(const char *path, const struct profile *p);
+
+int calibrate(struct profile *p, int width, int height,
+              enum AVCodecID codec_id);
+
+#endif /* CALIBRATE_H */
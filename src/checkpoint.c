@@ -0,0 +1,396 @@
+#include "checkpoint.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC "MOEXCKPT"
+#define CHECKPOINT_VERSION 7
+
+int init_checkpoint(struct checkpoint *ckpt, unsigned int nb_streams,
+                    int nb_video) {
+        ckpt->segment = 0;
+        ckpt->next_checkpoint = AV_NOPTS_VALUE;
+        ckpt->nb_streams = nb_streams;
+        ckpt->nb_video = nb_video;
+        ckpt->last_dts = malloc(nb_streams * sizeof(*ckpt->last_dts));
+        ckpt->frames = calloc(nb_video, sizeof(*ckpt->frames));
+        ckpt->replay_dts = malloc(nb_video * sizeof(*ckpt->replay_dts));
+        ckpt->skip_pts = malloc(nb_video * sizeof(*ckpt->skip_pts));
+        if (ckpt->last_dts == NULL || ckpt->frames == NULL ||
+            ckpt->replay_dts == NULL || ckpt->skip_pts == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate checkpoint\n");
+                return AVERROR(ENOMEM);
+        }
+
+        for (unsigned int i = 0; i < nb_streams; i++) {
+                ckpt->last_dts[i] = AV_NOPTS_VALUE;
+        }
+        for (int i = 0; i < nb_video; i++) {
+                ckpt->replay_dts[i] = AV_NOPTS_VALUE;
+                ckpt->skip_pts[i] = AV_NOPTS_VALUE;
+        }
+
+        return 0;
+}
+
+void free_checkpoint(struct checkpoint *ckpt) {
+        free(ckpt->last_dts);
+        free(ckpt->frames);
+        free(ckpt->replay_dts);
+        free(ckpt->skip_pts);
+        ckpt->last_dts = NULL;
+        ckpt->frames = NULL;
+        ckpt->replay_dts = NULL;
+        ckpt->skip_pts = NULL;
+}
+
+static int write_value(FILE *f, const void *value, size_t size) {
+        return fwrite(value, size, 1, f) == 1 ? 0 : -1;
+}
+
+static int read_value(FILE *f, void *value, size_t size) {
+        return fread(value, size, 1, f) == 1 ? 0 : -1;
+}
+
+/* Only the visible part of each plane is stored, without line padding */
+static int write_frame(FILE *f, const AVFrame *frame) {
+        int32_t dims[2] = {frame->width, frame->height};
+        if (write_value(f, dims, sizeof(dims)) < 0 ||
+            write_value(f, &frame->pts, sizeof(frame->pts)) < 0 ||
+            write_value(f, &frame->pkt_dts, sizeof(frame->pkt_dts)) < 0) {
+                return -1;
+        }
+
+        for (int p = 0; p < 3; p++) {
+                int w = p == 0 ? frame->width : (frame->width + 1) / 2;
+                int h = p == 0 ? frame->height : (frame->height + 1) / 2;
+                for (int y = 0; y < h; y++) {
+                        uint8_t *row = frame->data[p] + y * frame->linesize[p];
+                        if (fwrite(row, 1, w, f) != (size_t)w) {
+                                return -1;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+static AVFrame *read_frame(FILE *f) {
+        int32_t dims[2];
+        if (read_value(f, dims, sizeof(dims)) < 0 || dims[0] <= 0 ||
+            dims[1] <= 0) {
+                return NULL;
+        }
+
+        AVFrame *frame = av_frame_alloc();
+        if (frame == NULL) {
+                return NULL;
+        }
+
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = dims[0];
+        frame->height = dims[1];
+        if (av_frame_get_buffer(frame, 0) < 0 ||
+            read_value(f, &frame->pts, sizeof(frame->pts)) < 0 ||
+            read_value(f, &frame->pkt_dts, sizeof(frame->pkt_dts)) < 0) {
+                av_frame_free(&frame);
+                return NULL;
+        }
+
+        for (int p = 0; p < 3; p++) {
+                int w = p == 0 ? frame->width : (frame->width + 1) / 2;
+                int h = p == 0 ? frame->height : (frame->height + 1) / 2;
+                for (int y = 0; y < h; y++) {
+                        uint8_t *row = frame->data[p] + y * frame->linesize[p];
+                        if (fread(row, 1, w, f) != (size_t)w) {
+                                av_frame_free(&frame);
+                                return NULL;
+                        }
+                }
+        }
+
+        return frame;
+}
+
+static int write_map(FILE *f, const struct motion_map *map) {
+        int32_t dims[2] = {0, 0};
+        if (map != NULL) {
+                dims[0] = map->width;
+                dims[1] = map->height;
+        }
+        if (write_value(f, dims, sizeof(dims)) < 0) {
+                return -1;
+        }
+        if (map == NULL) {
+                return 0;
+        }
+
+        size_t n = (size_t)map->width * map->height;
+        if (write_value(f, &map->frames, sizeof(map->frames)) < 0 ||
+            write_value(f, &map->bucket, sizeof(map->bucket)) < 0 ||
+            fwrite(map->sum, sizeof(*map->sum), n, f) != n ||
+            fwrite(map->max, sizeof(*map->max), n, f) != n) {
+                return -1;
+        }
+
+        return 0;
+}
+
+static int read_map(FILE *f, struct motion_map *map) {
+        int32_t dims[2];
+        if (read_value(f, dims, sizeof(dims)) < 0) {
+                return AVERROR_INVALIDDATA;
+        }
+
+        if (map == NULL || dims[0] != map->width || dims[1] != map->height) {
+                if (map == NULL && dims[0] == 0) {
+                        return 0;
+                }
+                fprintf(stderr, "ERROR:   Checkpoint was made with a different "
+                                "--heatmap setting\n");
+                return AVERROR(EINVAL);
+        }
+
+        size_t n = (size_t)map->width * map->height;
+        if (read_value(f, &map->frames, sizeof(map->frames)) < 0 ||
+            read_value(f, &map->bucket, sizeof(map->bucket)) < 0 ||
+            fread(map->sum, sizeof(*map->sum), n, f) != n ||
+            fread(map->max, sizeof(*map->max), n, f) != n) {
+                return AVERROR_INVALIDDATA;
+        }
+
+        return 0;
+}
+
+static int write_state(FILE *f, const struct checkpoint *ckpt,
+                       struct frame_queue **queues, struct motion_map **maps,
+                       int nb_queues) {
+        int32_t header[10] = {CHECKPOINT_VERSION,   ckpt->delay,
+                              ckpt->interval,       ckpt->segment,
+                              ckpt->nb_streams,     nb_queues,
+                              ckpt->keyframes_only, ckpt->blend_kernel,
+                              ckpt->blend_threads,  ckpt->codec_threads};
+        int64_t input[2] = {ckpt->input_size, ckpt->input_duration};
+        if (fwrite(CHECKPOINT_MAGIC, 1, 8, f) != 8 ||
+            write_value(f, header, sizeof(header)) < 0 ||
+            write_value(f, input, sizeof(input)) < 0 ||
+            write_value(f, &ckpt->next_checkpoint,
+                        sizeof(ckpt->next_checkpoint)) < 0) {
+                return -1;
+        }
+
+        for (unsigned int i = 0; i < ckpt->nb_streams; i++) {
+                if (write_value(f, &ckpt->last_dts[i],
+                                sizeof(ckpt->last_dts[i])) < 0) {
+                        return -1;
+                }
+        }
+
+        // delay lines are stored oldest frame first, each followed by the
+        // stream's motion map if --heatmap is on
+        for (int i = 0; i < nb_queues; i++) {
+                int32_t size = queues[i]->size;
+                if (write_value(f, &ckpt->frames[i], sizeof(ckpt->frames[i])) <
+                        0 ||
+                    write_value(f, &ckpt->replay_dts[i],
+                                sizeof(ckpt->replay_dts[i])) < 0 ||
+                    write_value(f, &ckpt->skip_pts[i],
+                                sizeof(ckpt->skip_pts[i])) < 0 ||
+                    write_value(f, &size, sizeof(size)) < 0) {
+                        return -1;
+                }
+                for (struct queue_node *node = queues[i]->tail; node != NULL;
+                     node = node->prev) {
+                        if (write_frame(f, node->frame) < 0) {
+                                return -1;
+                        }
+                }
+                if (write_map(f, maps[i]) < 0) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/* Makes the rename of filename, and the segment files created next to it,
+ * survive a power loss */
+static int sync_directory(const char *filename) {
+        char *dir = strdup(filename);
+        if (dir == NULL) {
+                return AVERROR(ENOMEM);
+        }
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL) {
+                strcpy(dir, ".");
+        } else if (slash == dir) {
+                slash[1] = '\0';
+        } else {
+                slash[0] = '\0';
+        }
+
+        int ret = 0;
+        int fd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (fd < 0 || fsync(fd) < 0) {
+                ret = AVERROR(errno);
+        }
+        if (fd >= 0) {
+                close(fd);
+        }
+        free(dir);
+
+        return ret;
+}
+
+/* The state is written next to its final name and renamed into place, so a
+ * crash while saving leaves the previous checkpoint intact. The checkpoint
+ * only counts as saved once the directory is synced too. */
+int save_checkpoint(const char *filename, const struct checkpoint *ckpt,
+                    struct frame_queue **queues, struct motion_map **maps,
+                    int nb_queues) {
+        size_t len = strlen(filename) + 5;
+        char *tmp = malloc(len);
+        if (tmp == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate checkpoint\n");
+                return AVERROR(ENOMEM);
+        }
+        snprintf(tmp, len, "%s.tmp", filename);
+
+        FILE *f = fopen(tmp, "wb");
+        if (f == NULL) {
+                fprintf(stderr, "ERROR:   Could not open checkpoint file '%s'\n",
+                        tmp);
+                free(tmp);
+                return AVERROR(errno);
+        }
+
+        int ret = write_state(f, ckpt, queues, maps, nb_queues);
+        if (ret == 0 && (fflush(f) != 0 || fsync(fileno(f)) != 0)) {
+                ret = -1;
+        }
+        if (fclose(f) != 0) {
+                ret = -1;
+        }
+        if (ret == 0 && rename(tmp, filename) != 0) {
+                ret = -1;
+        }
+        if (ret == 0 && sync_directory(filename) < 0) {
+                ret = -1;
+        }
+        if (ret < 0) {
+                fprintf(stderr, "ERROR:   Failed to write checkpoint file\n");
+                remove(tmp);
+                ret = AVERROR(EIO);
+        }
+
+        free(tmp);
+        return ret;
+}
+
+static int read_state(FILE *f, struct checkpoint *ckpt,
+                      struct frame_queue **queues, struct motion_map **maps,
+                      int nb_queues) {
+        char magic[8];
+        int32_t header[10];
+        int64_t input[2];
+        if (fread(magic, 1, 8, f) != 8 ||
+            memcmp(magic, CHECKPOINT_MAGIC, 8) != 0 ||
+            read_value(f, header, sizeof(header)) < 0 ||
+            header[0] != CHECKPOINT_VERSION) {
+                fprintf(stderr, "ERROR:   Not a valid checkpoint file\n");
+                return AVERROR(EINVAL);
+        }
+
+        if (read_value(f, input, sizeof(input)) < 0) {
+                return AVERROR_INVALIDDATA;
+        }
+        if (input[0] != ckpt->input_size || input[1] != ckpt->input_duration) {
+                fprintf(stderr, "ERROR:   Checkpoint was made for a different "
+                                "input file\n");
+                return AVERROR(EINVAL);
+        }
+
+        if (header[1] != ckpt->delay || header[4] != (int)ckpt->nb_streams ||
+            header[5] != nb_queues || nb_queues != ckpt->nb_video ||
+            header[6] != ckpt->keyframes_only) {
+                fprintf(stderr, "ERROR:   Checkpoint was made with a different "
+                                "input, --delay or --keyframes-only\n");
+                return AVERROR(EINVAL);
+        }
+        if (ckpt->interval != 0 && header[2] != ckpt->interval) {
+                fprintf(stderr, "ERROR:   Checkpoint was made with "
+                                "--checkpoint %d\n",
+                        header[2]);
+                return AVERROR(EINVAL);
+        }
+        ckpt->interval = header[2];
+        ckpt->segment = header[3];
+        ckpt->blend_kernel = header[7];
+        ckpt->blend_threads = header[8];
+        ckpt->codec_threads = header[9];
+
+        if (read_value(f, &ckpt->next_checkpoint,
+                       sizeof(ckpt->next_checkpoint)) < 0) {
+                return AVERROR_INVALIDDATA;
+        }
+
+        for (unsigned int i = 0; i < ckpt->nb_streams; i++) {
+                if (read_value(f, &ckpt->last_dts[i],
+                               sizeof(ckpt->last_dts[i])) < 0) {
+                        return AVERROR_INVALIDDATA;
+                }
+        }
+
+        for (int i = 0; i < nb_queues; i++) {
+                int32_t size;
+                if (read_value(f, &ckpt->frames[i], sizeof(ckpt->frames[i])) <
+                        0 ||
+                    read_value(f, &ckpt->replay_dts[i],
+                               sizeof(ckpt->replay_dts[i])) < 0 ||
+                    read_value(f, &ckpt->skip_pts[i],
+                               sizeof(ckpt->skip_pts[i])) < 0 ||
+                    read_value(f, &size, sizeof(size)) < 0) {
+                        return AVERROR_INVALIDDATA;
+                }
+                for (int n = 0; n < size; n++) {
+                        AVFrame *frame = read_frame(f);
+                        if (frame == NULL) {
+                                return AVERROR_INVALIDDATA;
+                        }
+                        if (append_queue(queues[i], frame) < 0) {
+                                av_frame_free(&frame);
+                                return AVERROR_INVALIDDATA;
+                        }
+                }
+                int ret = read_map(f, maps[i]);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
+
+        return 0;
+}
+
+/* Returns AVERROR(ENOENT) if no checkpoint has been written yet. The
+ * caller fills in the input fingerprint, delay, interval (0 to take the
+ * saved one) and nb_streams before calling, they're checked against the
+ * file. */
+int load_checkpoint(const char *filename, struct checkpoint *ckpt,
+                    struct frame_queue **queues, struct motion_map **maps,
+                    int nb_queues) {
+        FILE *f = fopen(filename, "rb");
+        if (f == NULL) {
+                return AVERROR(errno);
+        }
+
+        int ret = read_state(f, ckpt, queues, maps, nb_queues);
+        if (ret == AVERROR_INVALIDDATA) {
+                fprintf(stderr, "ERROR:   Checkpoint file '%s' is truncated "
+                                "or corrupt\n",
+                        filename);
+        }
+
+        fclose(f);
+        return ret;
+}
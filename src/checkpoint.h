@@ -0,0 +1,53 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <libavcodec/avcodec.h>
+
+#include "heatmap.h"
+#include "queue.h"
+
+/*
+ * State needed to pick a job back up at a segment boundary. Timestamps in
+ * last_dts are in each input stream's own time base, the others in
+ * AV_TIME_BASE units. frames counts the frames each video stream has
+ * produced so far. A video stream that was idle at the checkpoint keeps its
+ * decoder going instead of being drained, so on resume it's decoded again
+ * from the keyframe at replay_dts (its own time base) and frames up to
+ * skip_pts are thrown away. Both are AV_NOPTS_VALUE for other streams. input_size and input_duration tell apart runs over
+ * different files that happen to have the same layout. The blend and codec
+ * thread settings are kept so a resumed job encodes exactly like the
+ * original one, whatever the host profile says by then.
+ */
+struct checkpoint {
+        int64_t input_size;
+        int64_t input_duration;
+        int delay;
+        int keyframes_only;
+        int blend_kernel;
+        int blend_threads;
+        int codec_threads;
+        int interval;
+        int segment;
+        int64_t next_checkpoint;
+        unsigned int nb_streams;
+        int64_t *last_dts;
+        int nb_video;
+        int64_t *frames;
+        int64_t *replay_dts;
+        int64_t *skip_pts;
+};
+
+int init_checkpoint(struct checkpoint *ckpt, unsigned int nb_streams,
+                    int nb_video);
+
+void free_checkpoint(struct checkpoint *ckpt);
+
+int save_checkpoint(const char *filename, const struct checkpoint *ckpt,
+                    struct frame_queue **queues, struct motion_map **maps,
+                    int nb_queues);
+
+int load_checkpoint(const char *filename, struct checkpoint *ckpt,
+                    struct frame_queue **queues, struct motion_map **maps,
+                    int nb_queues);
+
+#endif /* CHECKPOINT_H */
@@ -1,49 +1,227 @@
 #include "extraction.h"
 
-AVFrame *overlay_frames_yuv420p(AVFrame **cur, struct frame_queue *q) {
-        AVFrame *cur_copy = deep_copy_frame(*cur);
-        if (cur_copy == NULL) {
-                return NULL;
+const char *const blend_kernel_names[NB_BLEND_KERNELS] = {
+    [BLEND_SCALAR] = "scalar",
+    [BLEND_SWAR] = "swar",
+};
+
+struct blender_slice {
+        struct blender *b;
+        int index;
+};
+
+static void blend_row_scalar(uint8_t *dst, const uint8_t *cur, int width) {
+        for (int x = 0; x < width; x++) {
+                int byte = (255 - dst[x] + cur[x]) / 2;
+                if (byte > 255) {
+                        byte = 255;
+                }
+                dst[x] = byte;
         }
+}
 
-        AVFrame *delayed_frame = push_pop_queue(q, cur_copy);
+/* Same result as the scalar kernel, 8 pixels at a time in a 64 bit word:
+ * (255 - d + c) / 2 is the rounded down average of ~d and c, which can be
+ * computed per byte as (a & b) + ((a ^ b) >> 1) without carries between
+ * bytes. */
+static void blend_row_swar(uint8_t *dst, const uint8_t *cur, int width) {
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+                uint64_t d, c;
+                memcpy(&d, dst + x, 8);
+                memcpy(&c, cur + x, 8);
+                d = ~d;
+                d = (d & c) + (((d ^ c) >> 1) & 0x7f7f7f7f7f7f7f7fULL);
+                memcpy(dst + x, &d, 8);
+        }
+        blend_row_scalar(dst + x, cur + x, width - x);
+}
+
+static const blend_row_fn blend_rows[NB_BLEND_KERNELS] = {
+    [BLEND_SCALAR] = blend_row_scalar,
+    [BLEND_SWAR] = blend_row_swar,
+};
+
+static void blend_slice(blend_row_fn blend_row, const struct blend_job *job,
+                        int slice, int nb_slices) {
+        AVFrame *dst = job->dst;
+        const AVFrame *cur = job->cur;
 
         /* Y */
-        int Y_ls = delayed_frame->linesize[0];
-        for (int y = 0; y < delayed_frame->height; y++) {
-                for (int x = 0; x < delayed_frame->width; x++) {
-                        int byte = (255 - delayed_frame->data[0][y * Y_ls + x] +
-                                    cur_copy->data[0][y * Y_ls + x]) /
-                                   2;
-                        if (byte > 255) {
-                                byte = 255;
-                        }
-                        delayed_frame->data[0][y * Y_ls + x] = byte;
+        int y0 = dst->height * slice / nb_slices;
+        int y1 = dst->height * (slice + 1) / nb_slices;
+        for (int y = y0; y < y1; y++) {
+                uint8_t *dst_row = dst->data[0] + y * dst->linesize[0];
+                const uint8_t *cur_row = cur->data[0] + y * cur->linesize[0];
+                /* while the row is still in cache, before it's overwritten */
+                if (job->map != NULL) {
+                        accumulate_motion_row(job->map, y, cur_row, dst_row);
                 }
+                blend_row(dst_row, cur_row, dst->width);
         }
 
         /* Cb and Cr */
-        int Cb_ls = delayed_frame->linesize[1];
-        int Cr_ls = delayed_frame->linesize[2];
-        for (int y = 0; y < delayed_frame->height / 2; y++) {
-                for (int x = 0; x < delayed_frame->width / 2; x++) {
-                        int byte =
-                            (255 - delayed_frame->data[1][y * Cb_ls + x] +
-                             cur_copy->data[1][y * Cb_ls + x]) /
-                            2;
-                        if (byte > 255) {
-                                byte = 255;
-                        }
-                        delayed_frame->data[1][y * Cb_ls + x] = byte;
-
-                        byte = (255 - delayed_frame->data[2][y * Cr_ls + x] +
-                                cur_copy->data[2][y * Cr_ls + x]) /
-                               2;
-                        if (byte > 255) {
-                                byte = 255;
-                        }
-                        delayed_frame->data[2][y * Cr_ls + x] = byte;
+        y0 = dst->height / 2 * slice / nb_slices;
+        y1 = dst->height / 2 * (slice + 1) / nb_slices;
+        for (int p = 1; p < 3; p++) {
+                for (int y = y0; y < y1; y++) {
+                        blend_row(dst->data[p] + y * dst->linesize[p],
+                                  cur->data[p] + y * cur->linesize[p],
+                                  dst->width / 2);
+                }
+        }
+}
+
+static void *blender_thread(void *opaque) {
+        struct blender_slice *slice = opaque;
+        struct blender *b = slice->b;
+
+        /* nothing is queued before init_blender() returns */
+        unsigned int seen = 0;
+
+        pthread_mutex_lock(&b->lock);
+        while (1) {
+                while (b->generation == seen && !b->quit) {
+                        pthread_cond_wait(&b->start, &b->lock);
                 }
+                if (b->quit) {
+                        break;
+                }
+                seen = b->generation;
+                pthread_mutex_unlock(&b->lock);
+
+                blend_slice(b->blend_row, &b->job, slice->index,
+                            b->nb_threads);
+
+                pthread_mutex_lock(&b->lock);
+                b->pending -= 1;
+                if (b->pending == 0) {
+                        pthread_cond_signal(&b->done);
+                }
+        }
+        pthread_mutex_unlock(&b->lock);
+
+        return NULL;
+}
+
+struct blender *init_blender(enum blend_kernel kernel, int nb_threads) {
+        struct blender *b = calloc(1, sizeof(*b));
+        if (b == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate blender\n");
+                return b;
+        }
+
+        b->blend_row = blend_rows[kernel];
+        b->nb_threads = nb_threads > 0 ? nb_threads : 1;
+        pthread_mutex_init(&b->lock, NULL);
+        pthread_cond_init(&b->start, NULL);
+        pthread_cond_init(&b->done, NULL);
+
+        if (b->nb_threads == 1) {
+                return b;
+        }
+
+        /* slice 0 is done by whoever calls overlay_frames_yuv420p() */
+        b->threads = calloc(b->nb_threads, sizeof(*b->threads));
+        b->slices = calloc(b->nb_threads, sizeof(*b->slices));
+        if (b->threads == NULL || b->slices == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate blender\n");
+                free_blender(&b);
+                return NULL;
+        }
+
+        int started = 1;
+        for (; started < b->nb_threads; started++) {
+                b->slices[started].b = b;
+                b->slices[started].index = started;
+                if (pthread_create(&b->threads[started], NULL, blender_thread,
+                                   &b->slices[started]) != 0) {
+                        break;
+                }
+        }
+        if (started < b->nb_threads) {
+                fprintf(stderr, "ERROR:   Failed to start blender threads\n");
+                b->nb_threads = started;
+                free_blender(&b);
+                return NULL;
+        }
+
+        return b;
+}
+
+void free_blender(struct blender **b) {
+        if ((*b) == NULL) {
+                return;
+        }
+
+        pthread_mutex_lock(&(*b)->lock);
+        (*b)->quit = 1;
+        pthread_cond_broadcast(&(*b)->start);
+        pthread_mutex_unlock(&(*b)->lock);
+
+        if ((*b)->threads != NULL) {
+                for (int i = 1; i < (*b)->nb_threads; i++) {
+                        pthread_join((*b)->threads[i], NULL);
+                }
+        }
+
+        pthread_mutex_destroy(&(*b)->lock);
+        pthread_cond_destroy(&(*b)->start);
+        pthread_cond_destroy(&(*b)->done);
+        free((*b)->threads);
+        free((*b)->slices);
+        free(*b);
+        (*b) = NULL;
+}
+
+static void blend(struct blender *b, const struct blend_job *job) {
+        if (b == NULL) {
+                blend_slice(blend_row_scalar, job, 0, 1);
+                return;
+        }
+        if (b->nb_threads == 1) {
+                blend_slice(b->blend_row, job, 0, 1);
+                return;
+        }
+
+        pthread_mutex_lock(&b->lock);
+        b->job = *job;
+        b->pending = b->nb_threads - 1;
+        b->generation += 1;
+        pthread_cond_broadcast(&b->start);
+        pthread_mutex_unlock(&b->lock);
+
+        blend_slice(b->blend_row, job, 0, b->nb_threads);
+
+        pthread_mutex_lock(&b->lock);
+        while (b->pending > 0) {
+                pthread_cond_wait(&b->done, &b->lock);
+        }
+        pthread_mutex_unlock(&b->lock);
+}
+
+AVFrame *overlay_frames_yuv420p(AVFrame **cur, struct frame_queue *q,
+                                struct motion_map *map, struct blender *b) {
+        AVFrame *cur_copy = deep_copy_frame(*cur);
+        if (cur_copy == NULL) {
+                return NULL;
+        }
+
+        AVFrame *delayed_frame = push_pop_queue(q, cur_copy);
+
+        if (map != NULL && (map->width != delayed_frame->width ||
+                            map->height != delayed_frame->height)) {
+                map = NULL;
+        }
+
+        struct blend_job job = {
+            .dst = delayed_frame,
+            .cur = cur_copy,
+            .map = map,
+        };
+        blend(b, &job);
+        if (map != NULL) {
+                count_motion_frame(map);
         }
 
         av_frame_unref(*cur);
@@ -53,4 +231,4 @@ AVFrame *overlay_frames_yuv420p(AVFrame **cur, struct frame_queue *q) {
         delayed_frame->pkt_dts = cur_copy->pkt_dts;
 
         return delayed_frame;
-}
\ No newline at end of file
+}
@@ -2,10 +2,51 @@
 #define EXTRACTION_H
 
 #include <libavcodec/avcodec.h>
+#include <pthread.h>
 
+#include "heatmap.h"
 #include "queue.h"
 #include "utils.h"
 
-AVFrame *overlay_frames_yuv420p(AVFrame **cur, struct frame_queue *q);
+enum blend_kernel {
+        BLEND_SCALAR,
+        BLEND_SWAR,
+        NB_BLEND_KERNELS,
+};
 
-#endif /* EXTRACTION_H */
\ No newline at end of file
+typedef void (*blend_row_fn)(uint8_t *dst, const uint8_t *cur, int width);
+
+struct blend_job {
+        AVFrame *dst;
+        const AVFrame *cur;
+        struct motion_map *map;
+};
+
+/*
+ * Blends frames with one of the kernels, split by rows over nb_threads
+ * (the calling thread included).
+ */
+struct blender {
+        blend_row_fn blend_row;
+        int nb_threads;
+        pthread_t *threads;
+        struct blender_slice *slices;
+        pthread_mutex_t lock;
+        pthread_cond_t start;
+        pthread_cond_t done;
+        unsigned int generation;
+        int pending;
+        int quit;
+        struct blend_job job;
+};
+
+extern const char *const blend_kernel_names[NB_BLEND_KERNELS];
+
+struct blender *init_blender(enum blend_kernel kernel, int nb_threads);
+
+void free_blender(struct blender **b);
+
+AVFrame *overlay_frames_yuv420p(AVFrame **cur, struct frame_queue *q,
+                                struct motion_map *map, struct blender *b);
+
+#endif /* EXTRACTION_H */
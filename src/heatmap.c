@@ -0,0 +1,175 @@
+#include "heatmap.h"
+
+#include <stdio.h>
+
+struct motion_map *init_motion_map(int width, int height) {
+        struct motion_map *map = malloc(sizeof(*map));
+        if (map == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate motion map\n");
+                return map;
+        }
+
+        map->width = width;
+        map->height = height;
+        map->frames = 0;
+        map->bucket = AV_NOPTS_VALUE;
+        map->sum = calloc((size_t)width * height, sizeof(*map->sum));
+        map->max = calloc((size_t)width * height, sizeof(*map->max));
+        if (map->sum == NULL || map->max == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate motion map\n");
+                free_motion_map(&map);
+                return NULL;
+        }
+
+        return map;
+}
+
+void free_motion_map(struct motion_map **map) {
+        if ((*map) == NULL) {
+                return;
+        }
+        free((*map)->sum);
+        free((*map)->max);
+        free(*map);
+        (*map) = NULL;
+}
+
+void accumulate_motion_row(struct motion_map *map, int y, const uint8_t *cur,
+                           const uint8_t *delayed) {
+        uint32_t *sum = map->sum + (size_t)y * map->width;
+        uint8_t *max = map->max + (size_t)y * map->width;
+
+        for (int x = 0; x < map->width; x++) {
+                int diff = cur[x] - delayed[x];
+                if (diff < 0) {
+                        diff = -diff;
+                }
+                sum[x] += diff;
+                if (diff > max[x]) {
+                        max[x] = diff;
+                }
+        }
+}
+
+/* Called once per frame, after all of its rows were accumulated */
+void count_motion_frame(struct motion_map *map) {
+        map->frames++;
+}
+
+static int encode_png(const char *filename, AVFrame *frame) {
+        const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+        if (codec == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't find the PNG encoder\n");
+                return -1;
+        }
+
+        AVCodecContext *ctx = avcodec_alloc_context3(codec);
+        AVPacket *packet = av_packet_alloc();
+        if (ctx == NULL || packet == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't allocate PNG encoder\n");
+                avcodec_free_context(&ctx);
+                av_packet_free(&packet);
+                return AVERROR(ENOMEM);
+        }
+
+        ctx->width = frame->width;
+        ctx->height = frame->height;
+        ctx->pix_fmt = frame->format;
+        ctx->time_base = (AVRational){1, 1};
+
+        int ret = avcodec_open2(ctx, codec, NULL);
+        if (ret >= 0) {
+                ret = avcodec_send_frame(ctx, frame);
+        }
+        if (ret >= 0) {
+                ret = avcodec_receive_packet(ctx, packet);
+        }
+        if (ret < 0) {
+                fprintf(stderr, "ERROR:   Failed to encode motion map\n");
+                goto cleanup;
+        }
+
+        // write next to the target and rename, so viewers never see half
+        // an image while it's being updated
+        size_t len = strlen(filename) + 5;
+        char *tmp = malloc(len);
+        if (tmp == NULL) {
+                ret = AVERROR(ENOMEM);
+                goto cleanup;
+        }
+        snprintf(tmp, len, "%s.tmp", filename);
+
+        FILE *f = fopen(tmp, "wb");
+        if (f == NULL ||
+            fwrite(packet->data, 1, packet->size, f) != (size_t)packet->size) {
+                ret = AVERROR(EIO);
+        }
+        if (f != NULL && fclose(f) != 0) {
+                ret = AVERROR(EIO);
+        }
+        if (ret >= 0 && rename(tmp, filename) != 0) {
+                ret = AVERROR(EIO);
+        }
+        if (ret < 0) {
+                fprintf(stderr, "ERROR:   Could not write motion map '%s'\n",
+                        filename);
+                remove(tmp);
+        }
+        free(tmp);
+
+cleanup:
+        av_packet_free(&packet);
+        avcodec_free_context(&ctx);
+        return ret < 0 ? ret : 0;
+}
+
+/* Writes <prefix>-mean.png with the per-pixel mean difference and
+ * <prefix>-max.png with the per-pixel maximum. Both use the difference's
+ * own 0-255 scale, so images written at different times or from different
+ * clips can be compared directly. */
+int write_motion_map(const struct motion_map *map, const char *prefix) {
+        AVFrame *frame = av_frame_alloc();
+        size_t len = strlen(prefix) + 16;
+        char *filename = malloc(len);
+        if (frame == NULL || filename == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate motion map\n");
+                av_frame_free(&frame);
+                free(filename);
+                return AVERROR(ENOMEM);
+        }
+
+        frame->format = AV_PIX_FMT_GRAY8;
+        frame->width = map->width;
+        frame->height = map->height;
+        int ret = av_frame_get_buffer(frame, 0);
+        if (ret < 0) {
+                fprintf(stderr, "ERROR:   Failed to allocate motion map\n");
+                goto cleanup;
+        }
+
+        int64_t n = map->frames;
+        for (int y = 0; y < map->height; y++) {
+                const uint32_t *sum = map->sum + (size_t)y * map->width;
+                uint8_t *row = frame->data[0] + y * frame->linesize[0];
+                for (int x = 0; x < map->width; x++) {
+                        row[x] = n ? (sum[x] + n / 2) / n : 0;
+                }
+        }
+        snprintf(filename, len, "%s-mean.png", prefix);
+        ret = encode_png(filename, frame);
+        if (ret < 0) {
+                goto cleanup;
+        }
+
+        for (int y = 0; y < map->height; y++) {
+                memcpy(frame->data[0] + y * frame->linesize[0],
+                       map->max + (size_t)y * map->width, map->width);
+        }
+        snprintf(filename, len, "%s-max.png", prefix);
+        ret = encode_png(filename, frame);
+
+cleanup:
+        av_frame_free(&frame);
+        free(filename);
+        return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <libavcodec/avcodec.h>
+
+/*
+ * Per-pixel motion energy of the luma plane over the whole clip: the sum
+ * (for the mean over frames) and the max of |cur - delayed|, filled in by
+ * the blend. 32 bit sums hold about 16 million frames of constant
+ * full-scale motion.
+ */
+struct motion_map {
+        int width;
+        int height;
+        int64_t frames;
+        /* last interval written with --heatmap-interval */
+        int64_t bucket;
+        uint32_t *sum;
+        uint8_t *max;
+};
+
+struct motion_map *init_motion_map(int width, int height);
+
+void free_motion_map(struct motion_map **map);
+
+void accumulate_motion_row(struct motion_map *map, int y, const uint8_t *cur,
+                           const uint8_t *delayed);
+
+void count_motion_frame(struct motion_map *map);
+
+int write_motion_map(const struct motion_map *map, const char *prefix);
+
+#endif /* HEATMAP_H */
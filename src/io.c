@@ -0,0 +1,477 @@
+#include "io.h"
+
+#include <fcntl.h>
+#include <libavutil/avstring.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <sys/mount.h>
+#else
+#include <sys/vfs.h>
+#endif
+
+#define INPUT_BUFFER_SIZE (64 * 1024)
+#define READ_AHEAD_SIZE (16 * 1024 * 1024)
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define RING_SIZE (32 * 1024 * 1024)
+
+/* FFmpeg 7 made the buffer passed to write callbacks const */
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+#define WRITE_BUF_CONST const
+#else
+#define WRITE_BUF_CONST
+#endif
+
+struct mmap_input {
+        AVIOContext *pb;
+        uint8_t *data;
+        size_t size;
+        size_t pos;
+        /* end of the region we've already asked the kernel to page in */
+        size_t advised;
+        size_t page_size;
+};
+
+struct async_output {
+        AVIOContext *pb;
+        int fd;
+
+        uint8_t *ring;
+        size_t head;
+        size_t len;
+
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+        int closing;
+        int error;
+};
+
+/* The path to hand to open(2), or NULL when filename isn't a plain local
+ * file as far as libavformat's protocol layer is concerned */
+static const char *local_path(const char *filename) {
+        const char *protocol = avio_find_protocol_name(filename);
+        if (protocol == NULL || strcmp(protocol, "file") != 0) {
+                return NULL;
+        }
+        av_strstart(filename, "file:", &filename);
+        return filename;
+}
+
+/* Page faults on a mapping of a network or FUSE file turn server hiccups
+ * into SIGBUS instead of a read error, those files use normal reads */
+static int is_remote(int fd) {
+        struct statfs fs;
+        if (fstatfs(fd, &fs) < 0) {
+                return 1;
+        }
+
+#ifdef __APPLE__
+        static const char *const remote[] = {"nfs",    "smbfs",   "afpfs",
+                                             "webdav", "macfuse", "osxfuse"};
+        for (size_t i = 0; i < FF_ARRAY_ELEMS(remote); i++) {
+                if (strcmp(fs.f_fstypename, remote[i]) == 0) {
+                        return 1;
+                }
+        }
+#else
+        switch ((unsigned long)fs.f_type) {
+        case 0x6969:     // NFS
+        case 0x517b:     // SMB
+        case 0xff534d42: // CIFS
+        case 0xfe534d42: // SMB2
+        case 0x65735546: // FUSE
+        case 0x00c36400: // Ceph
+        case 0x01021997: // 9p
+        case 0x6b414653: // AFS
+                return 1;
+        }
+#endif
+
+        return 0;
+}
+
+static void read_ahead(struct mmap_input *in) {
+        if (in->pos + READ_AHEAD_SIZE / 2 < in->advised) {
+                return;
+        }
+
+        size_t start = in->pos & ~(in->page_size - 1);
+        if (start < in->advised) {
+                start = in->advised;
+        }
+        if (start >= in->size) {
+                return;
+        }
+
+        size_t len = FFMIN((size_t)READ_AHEAD_SIZE, in->size - start);
+        madvise(in->data + start, len, MADV_WILLNEED);
+        in->advised = start + len;
+}
+
+static int mmap_read(void *opaque, uint8_t *buf, int buf_size) {
+        struct mmap_input *in = opaque;
+
+        if (in->pos >= in->size) {
+                return AVERROR_EOF;
+        }
+
+        read_ahead(in);
+
+        size_t n = FFMIN((size_t)buf_size, in->size - in->pos);
+        memcpy(buf, in->data + in->pos, n);
+        in->pos += n;
+
+        return n;
+}
+
+static int64_t mmap_seek(void *opaque, int64_t offset, int whence) {
+        struct mmap_input *in = opaque;
+        int64_t pos;
+
+        switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+                return in->size;
+        case SEEK_SET:
+                pos = offset;
+                break;
+        case SEEK_CUR:
+                pos = in->pos + offset;
+                break;
+        case SEEK_END:
+                pos = in->size + offset;
+                break;
+        default:
+                return AVERROR(EINVAL);
+        }
+
+        if (pos < 0 || (size_t)pos > in->size) {
+                return AVERROR(EINVAL);
+        }
+
+        /* restart the read-ahead window at the new position */
+        in->pos = pos;
+        in->advised = pos & ~(in->page_size - 1);
+
+        return pos;
+}
+
+int open_mmap_input(AVFormatContext *fmt, const char *filename,
+                    struct mmap_input **in) {
+        const char *path = local_path(filename);
+        if (path == NULL) {
+                return AVERROR(EINVAL);
+        }
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                return AVERROR(errno);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+            is_remote(fd)) {
+                close(fd);
+                return AVERROR(EINVAL);
+        }
+
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        /* the mapping keeps the file referenced */
+        close(fd);
+        if (data == MAP_FAILED) {
+                return AVERROR(errno);
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+        (*in) = malloc(sizeof(**in));
+        uint8_t *buffer = av_malloc(INPUT_BUFFER_SIZE);
+        if ((*in) == NULL || buffer == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate input buffer\n");
+                av_free(buffer);
+                free(*in);
+                (*in) = NULL;
+                munmap(data, st.st_size);
+                return AVERROR(ENOMEM);
+        }
+
+        (*in)->data = data;
+        (*in)->size = st.st_size;
+        (*in)->pos = 0;
+        (*in)->advised = 0;
+        (*in)->page_size = sysconf(_SC_PAGESIZE);
+
+        (*in)->pb = avio_alloc_context(buffer, INPUT_BUFFER_SIZE, 0, (*in),
+                                       mmap_read, NULL, mmap_seek);
+        if ((*in)->pb == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate input context\n");
+                av_free(buffer);
+                close_mmap_input(in);
+                return AVERROR(ENOMEM);
+        }
+
+        fmt->pb = (*in)->pb;
+        fmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        return 0;
+}
+
+void close_mmap_input(struct mmap_input **in) {
+        if ((*in) == NULL) {
+                return;
+        }
+
+        if ((*in)->pb != NULL) {
+                av_freep(&(*in)->pb->buffer);
+                avio_context_free(&(*in)->pb);
+        }
+        munmap((*in)->data, (*in)->size);
+        free(*in);
+        (*in) = NULL;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+        while (len > 0) {
+                ssize_t n = write(fd, buf, len);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return AVERROR(errno);
+                }
+                buf += n;
+                len -= n;
+        }
+        return 0;
+}
+
+static void *writer_thread(void *opaque) {
+        struct async_output *out = opaque;
+
+        pthread_mutex_lock(&out->lock);
+        while (1) {
+                while (out->len == 0 && !out->closing) {
+                        pthread_cond_wait(&out->not_empty, &out->lock);
+                }
+                if (out->len == 0) {
+                        break;
+                }
+
+                /* the producer only appends past head + len, so the chunk
+                 * can be written without holding the lock */
+                size_t chunk = FFMIN(out->len, RING_SIZE - out->head);
+                pthread_mutex_unlock(&out->lock);
+
+                int ret = write_all(out->fd, out->ring + out->head, chunk);
+
+                pthread_mutex_lock(&out->lock);
+                if (ret < 0) {
+                        out->error = ret;
+                        out->len = 0;
+                        pthread_cond_broadcast(&out->not_full);
+                        break;
+                }
+                out->head = (out->head + chunk) % RING_SIZE;
+                out->len -= chunk;
+                pthread_cond_broadcast(&out->not_full);
+        }
+        pthread_mutex_unlock(&out->lock);
+
+        return NULL;
+}
+
+static int async_write(void *opaque, WRITE_BUF_CONST uint8_t *buf,
+                       int buf_size) {
+        struct async_output *out = opaque;
+        int written = 0;
+
+        pthread_mutex_lock(&out->lock);
+        while (written < buf_size) {
+                while (out->len == RING_SIZE && out->error == 0) {
+                        pthread_cond_wait(&out->not_full, &out->lock);
+                }
+                if (out->error < 0) {
+                        break;
+                }
+
+                size_t tail = (out->head + out->len) % RING_SIZE;
+                size_t n = FFMIN((size_t)(buf_size - written),
+                                 FFMIN(RING_SIZE - out->len, RING_SIZE - tail));
+                memcpy(out->ring + tail, buf + written, n);
+                out->len += n;
+                written += n;
+                pthread_cond_signal(&out->not_empty);
+        }
+        int ret = out->error < 0 ? out->error : written;
+        pthread_mutex_unlock(&out->lock);
+
+        return ret;
+}
+
+/* Waits until the writer thread has put everything in the ring on disk.
+ * The caller must hold out->lock. */
+static int drain_ring(struct async_output *out) {
+        while (out->len > 0) {
+                pthread_cond_wait(&out->not_full, &out->lock);
+        }
+        return out->error;
+}
+
+static int64_t async_seek(void *opaque, int64_t offset, int whence) {
+        struct async_output *out = opaque;
+        int64_t ret;
+
+        pthread_mutex_lock(&out->lock);
+        ret = drain_ring(out);
+        if (ret < 0) {
+                pthread_mutex_unlock(&out->lock);
+                return ret;
+        }
+
+        if ((whence & ~AVSEEK_FORCE) == AVSEEK_SIZE) {
+                struct stat st;
+                ret = fstat(out->fd, &st) < 0 ? AVERROR(errno) : st.st_size;
+        } else {
+                ret = lseek(out->fd, offset, whence & ~AVSEEK_FORCE);
+                if (ret < 0) {
+                        ret = AVERROR(errno);
+                }
+        }
+        pthread_mutex_unlock(&out->lock);
+
+        return ret;
+}
+
+int open_async_output(AVFormatContext *fmt, const char *filename,
+                      struct async_output **out) {
+        const char *path = local_path(filename);
+        if (path == NULL) {
+                return AVERROR(EINVAL);
+        }
+
+        // pipes and devices can't seek, leave them to libavformat. Check
+        // before opening, opening a FIFO would wait for its reader.
+        struct stat st;
+        if (stat(path, &st) == 0 && !S_ISREG(st.st_mode)) {
+                return AVERROR(EINVAL);
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                return AVERROR(errno);
+        }
+
+        // in case the path was swapped for something else in between
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+                close(fd);
+                return AVERROR(EINVAL);
+        }
+
+        (*out) = malloc(sizeof(**out));
+        if ((*out) == NULL) {
+                fprintf(stderr,
+                        "ERROR:   Failed to allocate output writer\n");
+                close(fd);
+                return AVERROR(ENOMEM);
+        }
+
+        (*out)->fd = fd;
+        (*out)->head = 0;
+        (*out)->len = 0;
+        (*out)->closing = 0;
+        (*out)->error = 0;
+        (*out)->ring = malloc(RING_SIZE);
+        uint8_t *buffer = av_malloc(OUTPUT_BUFFER_SIZE);
+        if ((*out)->ring == NULL || buffer == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate output buffer\n");
+                av_free(buffer);
+                free((*out)->ring);
+                free(*out);
+                (*out) = NULL;
+                close(fd);
+                return AVERROR(ENOMEM);
+        }
+
+        (*out)->pb = avio_alloc_context(buffer, OUTPUT_BUFFER_SIZE, 1, (*out),
+                                        NULL, async_write, async_seek);
+        if ((*out)->pb == NULL) {
+                fprintf(stderr,
+                        "ERROR:   Failed to allocate output context\n");
+                av_free(buffer);
+                free((*out)->ring);
+                free(*out);
+                (*out) = NULL;
+                close(fd);
+                return AVERROR(ENOMEM);
+        }
+
+        pthread_mutex_init(&(*out)->lock, NULL);
+        pthread_cond_init(&(*out)->not_empty, NULL);
+        pthread_cond_init(&(*out)->not_full, NULL);
+
+        int ret = pthread_create(&(*out)->thread, NULL, writer_thread, (*out));
+        if (ret != 0) {
+                fprintf(stderr, "ERROR:   Failed to start output writer\n");
+                pthread_mutex_destroy(&(*out)->lock);
+                pthread_cond_destroy(&(*out)->not_empty);
+                pthread_cond_destroy(&(*out)->not_full);
+                av_freep(&(*out)->pb->buffer);
+                avio_context_free(&(*out)->pb);
+                free((*out)->ring);
+                free(*out);
+                (*out) = NULL;
+                close(fd);
+                return AVERROR(ret);
+        }
+
+        fmt->pb = (*out)->pb;
+        fmt->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        return 0;
+}
+
+int close_async_output(AVFormatContext *fmt, struct async_output **out,
+                       int sync) {
+        if ((*out) == NULL) {
+                return 0;
+        }
+
+        avio_flush((*out)->pb);
+
+        pthread_mutex_lock(&(*out)->lock);
+        (*out)->closing = 1;
+        pthread_cond_signal(&(*out)->not_empty);
+        pthread_mutex_unlock(&(*out)->lock);
+
+        pthread_join((*out)->thread, NULL);
+
+        int ret = (*out)->error;
+        if (sync && ret == 0 && fsync((*out)->fd) < 0) {
+                ret = AVERROR(errno);
+        }
+        if (close((*out)->fd) < 0 && ret == 0) {
+                ret = AVERROR(errno);
+        }
+        if (ret < 0) {
+                fprintf(stderr, "ERROR:   Failed writing the output file "
+                                "(error: %s)\n",
+                        av_err2str(ret));
+        }
+
+        pthread_mutex_destroy(&(*out)->lock);
+        pthread_cond_destroy(&(*out)->not_empty);
+        pthread_cond_destroy(&(*out)->not_full);
+        av_freep(&(*out)->pb->buffer);
+        avio_context_free(&(*out)->pb);
+        free((*out)->ring);
+        free(*out);
+        (*out) = NULL;
+        // don't leave the format context pointing at the freed context
+        fmt->pb = NULL;
+
+        return ret;
+}
@@ -0,0 +1,33 @@
+#ifndef IO_H
+#define IO_H
+
+#include <libavformat/avformat.h>
+
+/*
+ * Custom I/O for the input and output files. Local input files are
+ * memory-mapped and read through an AVIOContext with read-ahead hints.
+ * Output is written by a separate thread that drains a large ring buffer,
+ * so slow storage does not stall decoding and encoding.
+ *
+ * Both open functions return a negative error code when the file can't be
+ * handled this way (e.g. it's a URL rather than a local path, or the input
+ * is on a network or FUSE mount where mapping it isn't safe). The caller
+ * should then fall back to libavformat's own file I/O.
+ */
+
+struct mmap_input;
+struct async_output;
+
+int open_mmap_input(AVFormatContext *fmt, const char *filename,
+                    struct mmap_input **in);
+
+void close_mmap_input(struct mmap_input **in);
+
+int open_async_output(AVFormatContext *fmt, const char *filename,
+                      struct async_output **out);
+
+/* With sync set, the data is flushed to stable storage before closing */
+int close_async_output(AVFormatContext *fmt, struct async_output **out,
+                       int sync);
+
+#endif /* IO_H */
@@ -1,18 +1,107 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "calibrate.h"
+#include "checkpoint.h"
 #include "extraction.h"
+#include "io.h"
+#include "packet_queue.h"
 #include "queue.h"
 
+#define PACKET_QUEUE_SIZE 64
+#define SEGMENT_FORMAT "nut"
+/* a video stream without packets for this long doesn't hold up a checkpoint */
+#define STREAM_IDLE_TIME 10
+/* give up on a checkpoint rather than hold back more packets than this */
+#define MAX_HELD_PACKETS 4096
+
 struct parameters {
         char *ifile;
         char *ofile;
         int delay;
+        int checkpoint;
+        int resume;
+        char *heatmap;
+        int heatmap_interval;
+        int keyframes_only;
+        int calibrate;
+        struct profile profile;
+};
+
+/* Everything needed to process one video stream on its own thread */
+struct video_stream {
+        int index;
+        AVCodecContext *decoder_ctx;
+        AVCodecContext *encoder_ctx;
+        struct frame_queue *q;
+        struct blender *blender;
+        struct packet_queue *packets;
+        struct motion_map *map;
+        char *map_prefix;
+        int map_interval;
+        int out_index;
+        /* with --keyframes-only frames are retimed to one per frame_duration */
+        int64_t frame_duration;
+        int64_t frames;
+        /* pts of the last frame taken from the decoder, and frames up to
+         * skip_pts are thrown away while an idle stream is decoded again */
+        int64_t last_pts;
+        int64_t skip_pts;
+        /* cleared for idle streams at a checkpoint, see take_checkpoint() */
+        int drain_decoder;
+        AVFormatContext *ifmt_ctx;
+        AVFormatContext *ofmt_ctx;
+        pthread_t thread;
+        int running;
+        int ret;
+};
+
+/*
+ * Bookkeeping for --checkpoint. Output goes to numbered segment files which
+ * are joined into the real output file at the end. Once a checkpoint is
+ * due, video packets are held back stream by stream from their next
+ * keyframe on, and the segment is closed when every video stream got there
+ * or went idle. If that takes too long the checkpoint is skipped.
+ */
+struct segmenter {
+        struct checkpoint state;
+        const char *ofile;
+        char *state_file;
+        char *segment_file;
+        size_t name_len;
+        const AVOutputFormat *container;
+        struct frame_queue **queues;
+        struct motion_map **maps;
+        int pending;
+        int64_t pending_ts;
+        int nb_reached;
+        int *reached;
+        int *resyncing;
+        int *idle;
+        int64_t *last_seen;
+        int64_t *key_dts;
+        AVPacket **held;
+        int nb_held;
+        int held_cap;
+};
+
+struct job {
+        AVFormatContext *ifmt_ctx;
+        AVFormatContext *ofmt_ctx;
+        struct mmap_input *input;
+        struct async_output *output;
+        struct video_stream *streams;
+        int nb_video;
+        int *stream_map;
+        int keyframes_only;
+        int codec_threads;
+        struct segmenter *seg;
 };
 
 static int64_t duration;
@@ -20,18 +109,50 @@ static AVRational time_base;
 static int64_t max_pts = -1;
 static time_t last_time = -1;
 static time_t cur_time = -1;
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void print_help(char *argv[]) {
         printf("Usage: %s [--help | -h] [--freeze | -f] [--delay <number>]\n"
+               "       %*s [--keyframes-only | -k]\n"
+               "       %*s [--checkpoint <seconds>] [--resume]\n"
+               "       %*s [--heatmap <name>] [--heatmap-interval <seconds>]\n"
                "       %*s <input file> <output file>\n"
+               "       %s --calibrate [<input file>]\n"
                "\n",
-               argv[0], (int)strlen(argv[0]), "");
+               argv[0], (int)strlen(argv[0]), "", (int)strlen(argv[0]), "",
+               (int)strlen(argv[0]), "", (int)strlen(argv[0]), "", argv[0]);
         printf("Getting help:\n"
                "   --help (or -h)     print basic options\n"
                "\n");
         printf("Motion extraction options:\n"
                "   --delay <number>   set extraction frame delay\n"
                "   --freeze (or -f)   extract relative to the first frame\n"
+               "   --keyframes-only (or -k)\n"
+               "                      only decode keyframes for a fast "
+               "time-lapse\n"
+               "                      overview, --delay counts keyframes\n"
+               "\n");
+        printf("Motion map options:\n"
+               "   --heatmap <name>   also write where motion happened to\n"
+               "                      <name>-mean.png and <name>-max.png\n"
+               "   --heatmap-interval <sec>\n"
+               "                      update the motion map every <sec> "
+               "seconds\n"
+               "\n");
+        printf("Long running jobs:\n"
+               "   --checkpoint <sec> save progress every <sec> seconds of "
+               "video\n"
+               "   --resume           continue from the last saved "
+               "checkpoint\n"
+               "\n");
+        printf("Tuning:\n"
+               "   --calibrate        benchmark this machine and save the "
+               "fastest\n"
+               "                      blend and codec settings for the input's\n"
+               "                      resolution and codec (1080p H.264 "
+               "without\n"
+               "                      one), later runs on matching input "
+               "use them\n"
                "\n");
 }
 
@@ -80,6 +201,11 @@ static int parse_args(int argc, char *argv[], struct parameters *params) {
                                 params->delay = 0;
                                 continue;
                         }
+                        if (strcmp("-k", argv[i]) == 0 ||
+                            strcmp("--keyframes-only", argv[i]) == 0) {
+                                params->keyframes_only = 1;
+                                continue;
+                        }
                         if (strcmp("--delay", argv[i]) == 0) {
                                 if (i + 1 >= argc || argv[i + 1][0] == '-') {
                                         // do nothing or prompt user for number?
@@ -113,6 +239,63 @@ static int parse_args(int argc, char *argv[], struct parameters *params) {
                                 i++;
                                 continue;
                         }
+                        if (strcmp("--checkpoint", argv[i]) == 0) {
+                                int val = 0;
+                                if (i + 1 < argc) {
+                                        val = strtol(argv[i + 1], NULL, 10);
+                                }
+                                if (val <= 0) {
+                                        fprintf(stderr,
+                                                "\033[91mError!\033[0m "
+                                                "--checkpoint flag must be "
+                                                "followed by a number of "
+                                                "seconds, for example: "
+                                                "--checkpoint 600\n");
+                                        return -1;
+                                }
+                                params->checkpoint = val;
+                                i++;
+                                continue;
+                        }
+                        if (strcmp("--heatmap", argv[i]) == 0) {
+                                if (i + 1 >= argc || argv[i + 1][0] == '-') {
+                                        fprintf(stderr,
+                                                "\033[91mError!\033[0m "
+                                                "--heatmap flag must be "
+                                                "followed by a name, for "
+                                                "example: --heatmap motion\n");
+                                        return -1;
+                                }
+                                params->heatmap = argv[i + 1];
+                                i++;
+                                continue;
+                        }
+                        if (strcmp("--heatmap-interval", argv[i]) == 0) {
+                                int val = 0;
+                                if (i + 1 < argc) {
+                                        val = strtol(argv[i + 1], NULL, 10);
+                                }
+                                if (val <= 0) {
+                                        fprintf(stderr,
+                                                "\033[91mError!\033[0m "
+                                                "--heatmap-interval flag must "
+                                                "be followed by a number of "
+                                                "seconds, for example: "
+                                                "--heatmap-interval 60\n");
+                                        return -1;
+                                }
+                                params->heatmap_interval = val;
+                                i++;
+                                continue;
+                        }
+                        if (strcmp("--resume", argv[i]) == 0) {
+                                params->resume = 1;
+                                continue;
+                        }
+                        if (strcmp("--calibrate", argv[i]) == 0) {
+                                params->calibrate = 1;
+                                continue;
+                        }
                         unknown_flags[unknown_sz] = argv[i];
                         unknown_sz++;
                 } else {
@@ -124,6 +307,11 @@ static int parse_args(int argc, char *argv[], struct parameters *params) {
                 }
         }
 
+        if (params->heatmap_interval > 0 && params->heatmap == NULL) {
+                printf("\033[93mWarning! \033[0m --heatmap-interval "
+                       "flag is ignored without --heatmap\n");
+        }
+
         if (frozen == 1 && delay == 1) {
                 params->delay = 0;
                 printf("\033[93mWarning! \033[0mThe --frozen (-f) flag takes "
@@ -143,7 +331,17 @@ static int parse_args(int argc, char *argv[], struct parameters *params) {
         return 0;
 }
 
-static int open_input_file(AVFormatContext **ifmt, const char *filename) {
+static int open_input_file(AVFormatContext **ifmt, struct mmap_input **in,
+                           const char *filename) {
+        (*ifmt) = avformat_alloc_context();
+        if ((*ifmt) == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate input context\n");
+                return -1;
+        }
+
+        // anything that can't be mapped (URLs, pipes) uses libavformat's I/O
+        open_mmap_input(*ifmt, filename, in);
+
         int ret = avformat_open_input(ifmt, filename, NULL, NULL);
         if (ret < 0) {
                 fprintf(stderr, "ERROR:   Failed to open input file\n");
@@ -160,14 +358,20 @@ static int open_input_file(AVFormatContext **ifmt, const char *filename) {
         return 0;
 }
 
-static int open_output_file(AVFormatContext **ofmt, const char *filename) {
-        int ret = avformat_alloc_output_context2(ofmt, NULL, NULL, filename);
+static int open_output_file(AVFormatContext **ofmt, struct async_output **out,
+                            const char *filename, const char *format) {
+        int ret = avformat_alloc_output_context2(ofmt, NULL, format, filename);
         if (ret < 0) {
                 fprintf(stderr, "ERROR:   Failed to allocate output context\n");
                 return ret;
         }
 
         if (!((*ofmt)->oformat->flags & AVFMT_NOFILE)) {
+                ret = open_async_output(*ofmt, filename, out);
+                if (ret == 0) {
+                        return 0;
+                }
+
                 ret = avio_open(&(*ofmt)->pb, filename, AVIO_FLAG_WRITE);
                 if (ret < 0) {
                         fprintf(stderr,
@@ -180,9 +384,36 @@ static int open_output_file(AVFormatContext **ofmt, const char *filename) {
         return 0;
 }
 
+static int close_output_file(AVFormatContext **ofmt,
+                             struct async_output **out, int sync) {
+        int ret = 0;
+        if ((*out) != NULL)
+                ret = close_async_output(*ofmt, out, sync);
+        else if ((*ofmt) && !((*ofmt)->oformat->flags & AVFMT_NOFILE) &&
+                 !((*ofmt)->flags & AVFMT_FLAG_CUSTOM_IO))
+                avio_closep(&(*ofmt)->pb);
+        avformat_free_context(*ofmt);
+        (*ofmt) = NULL;
+        return ret;
+}
+
+/* Video streams that get the effect. Cover art is a video stream too, but
+ * a single still image in whatever format, it's copied like audio. */
+static int is_extracted_stream(const AVStream *stream) {
+        return stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+               !(stream->disposition & AV_DISPOSITION_ATTACHED_PIC);
+}
+
+/* Streams the demuxer is told to discard aren't written, stream_map gets
+ * each input stream's output index or -1 */
 static int create_output_streams(AVFormatContext *ifmt, AVFormatContext *ofmt,
-                                 int *video_stream) {
+                                 int *stream_map) {
         for (unsigned int i = 0; i < ifmt->nb_streams; i++) {
+                if (ifmt->streams[i]->discard == AVDISCARD_ALL) {
+                        stream_map[i] = -1;
+                        continue;
+                }
+
                 AVStream *stream = avformat_new_stream(ofmt, NULL);
                 if (stream == NULL) {
                         fprintf(stderr, "ERROR:   Failed to add stream to the "
@@ -197,27 +428,19 @@ static int create_output_streams(AVFormatContext *ifmt, AVFormatContext *ofmt,
                                         "to out stream\n");
                         return -1;
                 }
+                stream->disposition = ifmt->streams[i]->disposition;
 
-                if (ifmt->streams[i]->codecpar->codec_type ==
-                    AVMEDIA_TYPE_VIDEO) {
-                        *video_stream = i;
-                }
-
+                stream_map[i] = stream->index;
                 duration = ifmt->streams[i]->duration;
                 time_base = ifmt->streams[i]->time_base;
         }
 
-        if (*video_stream < 0) {
-                fprintf(stderr, "ERROR:   Program only supports video files "
-                                "with one video stream\n");
-                return -1;
-        }
-
         return 0;
 }
 
 static int configure_decoder(AVFormatContext *ifmt,
-                             AVCodecContext **decoder_ctx, int video) {
+                             AVCodecContext **decoder_ctx, int video,
+                             int keyframes_only, int threads) {
         const AVCodec *decoder =
             avcodec_find_decoder(ifmt->streams[video]->codecpar->codec_id);
         if (decoder == NULL) {
@@ -244,6 +467,11 @@ static int configure_decoder(AVFormatContext *ifmt,
                 return ret;
         }
 
+        if (keyframes_only)
+                (*decoder_ctx)->skip_frame = AVDISCARD_NONKEY;
+        if (threads > 0)
+                (*decoder_ctx)->thread_count = threads;
+
         ret = avcodec_open2((*decoder_ctx), decoder, NULL);
         if (ret < 0) {
                 fprintf(stderr,
@@ -262,11 +490,15 @@ static int configure_decoder(AVFormatContext *ifmt,
         return 0;
 }
 
+/* container is the format the stream finally ends up in, which differs from
+ * ofmt's while writing checkpoint segments */
 static int configure_encoder(AVFormatContext *ifmt, AVFormatContext *ofmt,
+                             const AVOutputFormat *container,
                              AVCodecContext **encoder_ctx,
-                             AVCodecContext *decoder_ctx, int video) {
+                             AVCodecContext *decoder_ctx, int video, int out,
+                             int threads) {
         const AVCodec *encoder =
-            avcodec_find_encoder(ofmt->streams[video]->codecpar->codec_id);
+            avcodec_find_encoder(ofmt->streams[out]->codecpar->codec_id);
         if (encoder == NULL) {
                 fprintf(stderr, "ERROR:   Couldn't find the encoder/decoder\n");
                 return -1;
@@ -287,8 +519,10 @@ static int configure_encoder(AVFormatContext *ifmt, AVFormatContext *ofmt,
         (*encoder_ctx)->pix_fmt = decoder_ctx->pix_fmt;
         (*encoder_ctx)->time_base =
             av_inv_q(av_guess_frame_rate(ifmt, ifmt->streams[video], NULL));
+        if (threads > 0)
+                (*encoder_ctx)->thread_count = threads;
 
-        if (ofmt->oformat->flags & AVFMT_GLOBALHEADER)
+        if (container->flags & AVFMT_GLOBALHEADER)
                 (*encoder_ctx)->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
         int ret = avcodec_open2((*encoder_ctx), encoder, NULL);
@@ -298,7 +532,7 @@ static int configure_encoder(AVFormatContext *ifmt, AVFormatContext *ofmt,
                 return ret;
         }
 
-        ret = avcodec_parameters_from_context(ofmt->streams[video]->codecpar,
+        ret = avcodec_parameters_from_context(ofmt->streams[out]->codecpar,
                                               (*encoder_ctx));
         if (ret < 0) {
                 fprintf(stderr,
@@ -334,15 +568,20 @@ static void print_report(int64_t pts) {
         last_time = cur_time;
 }
 
+/* packet comes in with its input stream index and timestamps */
 static int mux(AVFormatContext *iformat_context,
-               AVFormatContext *oformat_context, AVPacket *packet) {
-        print_report(packet->pts);
+               AVFormatContext *oformat_context, AVPacket *packet,
+               int out_index) {
+        // called from every stream's thread, the muxer isn't thread safe
+        pthread_mutex_lock(&mux_lock);
 
         av_packet_rescale_ts(
             packet, iformat_context->streams[packet->stream_index]->time_base,
-            oformat_context->streams[packet->stream_index]->time_base);
+            oformat_context->streams[out_index]->time_base);
+        packet->stream_index = out_index;
 
         int ret = av_interleaved_write_frame(oformat_context, packet);
+        pthread_mutex_unlock(&mux_lock);
         if (ret < 0) {
                 fprintf(stderr,
                         "ERROR:   Failed to write packet to output file\n");
@@ -351,14 +590,12 @@ static int mux(AVFormatContext *iformat_context,
         return 0;
 }
 
-static int recieve_packets(AVCodecContext *encoder_ctx, AVPacket *packet,
-                           AVFormatContext *ifmt_ctx,
-                           AVFormatContext *ofmt_ctx) {
+static int recieve_packets(struct video_stream *vs, AVPacket *packet) {
         int ret;
         while (1) {
                 av_packet_unref(packet);
 
-                ret = avcodec_receive_packet(encoder_ctx, packet);
+                ret = avcodec_receive_packet(vs->encoder_ctx, packet);
                 if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
                         return 0;
                 if (ret < 0) {
@@ -367,20 +604,39 @@ static int recieve_packets(AVCodecContext *encoder_ctx, AVPacket *packet,
                         return ret;
                 }
 
-                ret = mux(ifmt_ctx, ofmt_ctx, packet);
+                packet->stream_index = vs->index;
+                ret = mux(vs->ifmt_ctx, vs->ofmt_ctx, packet, vs->out_index);
                 if (ret < 0)
                         return ret;
         }
 }
 
-static int recieve_frames(AVCodecContext *decoder_ctx,
-                          AVCodecContext *encoder_ctx, AVFrame **frame,
-                          struct frame_queue *q, AVPacket *packet,
-                          AVFormatContext *ifmt_ctx,
-                          AVFormatContext *ofmt_ctx) {
+/* Rewrites the motion map images whenever pts enters a new interval */
+static int update_motion_map(struct video_stream *vs, int64_t pts) {
+        if (vs->map == NULL || vs->map_interval <= 0 ||
+            pts == AV_NOPTS_VALUE) {
+                return 0;
+        }
+
+        int64_t bucket = av_rescale_q_rnd(
+            pts, vs->ifmt_ctx->streams[vs->index]->time_base,
+            (AVRational){vs->map_interval, 1}, AV_ROUND_DOWN);
+        if (vs->map->bucket == AV_NOPTS_VALUE) {
+                vs->map->bucket = bucket;
+        }
+        if (bucket <= vs->map->bucket) {
+                return 0;
+        }
+
+        vs->map->bucket = bucket;
+        return write_motion_map(vs->map, vs->map_prefix);
+}
+
+static int recieve_frames(struct video_stream *vs, AVFrame **frame,
+                          AVPacket *packet) {
         int ret;
         while (1) {
-                ret = avcodec_receive_frame(decoder_ctx, (*frame));
+                ret = avcodec_receive_frame(vs->decoder_ctx, (*frame));
                 if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
                         return 0;
                 if (ret < 0) {
@@ -389,11 +645,30 @@ static int recieve_frames(AVCodecContext *decoder_ctx,
                         return ret;
                 }
 
-                (*frame)->pts = (*frame)->best_effort_timestamp;
+                int64_t pts = (*frame)->best_effort_timestamp;
+                if (vs->skip_pts != AV_NOPTS_VALUE) {
+                        if (pts != AV_NOPTS_VALUE && pts <= vs->skip_pts) {
+                                av_frame_unref((*frame));
+                                continue;
+                        }
+                        vs->skip_pts = AV_NOPTS_VALUE;
+                }
+                vs->last_pts = pts;
+                (*frame)->pts = pts;
+                if (vs->frame_duration > 0) {
+                        (*frame)->pts = vs->frames * vs->frame_duration;
+                }
+                vs->frames++;
+
+                (*frame) = overlay_frames_yuv420p(frame, vs->q, vs->map,
+                                                  vs->blender);
 
-                (*frame) = overlay_frames_yuv420p(frame, q);
+                ret = update_motion_map(vs, pts);
+                if (ret < 0) {
+                        return ret;
+                }
 
-                ret = avcodec_send_frame(encoder_ctx, (*frame));
+                ret = avcodec_send_frame(vs->encoder_ctx, (*frame));
                 if (ret < 0) {
                         fprintf(stderr,
                                 "ERROR:   Failed sending frame "
@@ -403,7 +678,7 @@ static int recieve_frames(AVCodecContext *decoder_ctx,
                         return ret;
                 }
 
-                ret = recieve_packets(encoder_ctx, packet, ifmt_ctx, ofmt_ctx);
+                ret = recieve_packets(vs, packet);
                 if (ret < 0) {
                         return ret;
                 }
@@ -412,168 +687,1178 @@ static int recieve_frames(AVCodecContext *decoder_ctx,
         }
 }
 
-int main(int argc, char *argv[]) {
-        av_log_set_level(AV_LOG_QUIET);
+static int decode_stream(struct video_stream *vs, AVFrame **frame,
+                         AVPacket *packet) {
+        int ret;
+        while (1) {
+                AVPacket *in;
+                ret = get_packet(vs->packets, &in);
+                if (ret < 0) {
+                        return ret;
+                }
+                if (in == NULL) {
+                        break;
+                }
 
-        struct parameters params = {.delay = 2};
+                ret = avcodec_send_packet(vs->decoder_ctx, in);
+                av_packet_free(&in);
+                if (ret < 0) {
+                        fprintf(stderr,
+                                "ERROR:   Failed sending packet to decoder\n");
+                        return ret;
+                }
+                ret = recieve_frames(vs, frame, packet);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
 
-        int ret = parse_args(argc, argv, &params);
-        switch (ret) {
-        case 1:
-                return 0;
-        case 0:
-                break;
-        default:
+        if (vs->drain_decoder) {
+                ret = avcodec_send_packet(vs->decoder_ctx, NULL);
+                if (ret < 0) {
+                        fprintf(stderr, "ERROR:   Failed to flush decoder\n");
+                        return ret;
+                }
+                ret = recieve_frames(vs, frame, packet);
+                if (ret < 0)
+                        return ret;
+        }
+
+        ret = avcodec_send_frame(vs->encoder_ctx, NULL);
+        if (ret < 0) {
+                fprintf(stderr, "ERROR:   Failed to flush encoder\n");
                 return ret;
         }
+        return recieve_packets(vs, packet);
+}
 
-        // prompt for conformation if output file is being overwritten
-        // The video specified for output already exists, write over it?
-        // avio_check()?
+static void *process_stream(void *opaque) {
+        struct video_stream *vs = opaque;
 
-        printf("\033[1mMotion Extracting...\033[0m\n"
-               "  Input Video: %s\n"
-               "  Output Video: %s\n",
-               params.ifile, params.ofile);
-        char *fr_msg = "";
-        if (params.delay == 0) {
-                fr_msg = "(Frozen)";
+        AVPacket *packet = av_packet_alloc();
+        AVFrame *frame = av_frame_alloc();
+        if (packet == NULL || frame == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't allocate packet/frame\n");
+                vs->ret = AVERROR(ENOMEM);
+        } else {
+                vs->ret = decode_stream(vs, &frame, packet);
         }
-        printf("  delay: %d %s\n\n", params.delay, fr_msg);
 
-        AVFormatContext *ifmt_ctx = NULL;
-        AVFormatContext *ofmt_ctx = NULL;
-        AVCodecContext *decoder_ctx = NULL;
-        AVCodecContext *encoder_ctx = NULL;
-        struct frame_queue *q = init_queue(params.delay);
-        AVPacket *packet = NULL;
-        AVFrame *frame = NULL;
-        int video_stream = -1;
+        // stop the demuxer from waiting on a queue nobody reads anymore
+        if (vs->ret < 0) {
+                abort_packet_queue(vs->packets);
+        }
 
-        ret = open_input_file(&ifmt_ctx, params.ifile);
-        if (ret < 0) {
-                goto cleanup;
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+
+        return NULL;
+}
+
+static int open_motion_map(struct video_stream *vs,
+                           struct parameters *params, int nb_video) {
+        vs->map = init_motion_map(vs->decoder_ctx->width,
+                                  vs->decoder_ctx->height);
+        size_t len = strlen(params->heatmap) + 16;
+        vs->map_prefix = malloc(len);
+        if (vs->map == NULL || vs->map_prefix == NULL) {
+                return AVERROR(ENOMEM);
         }
+        vs->map_interval = params->heatmap_interval;
 
-        // av_log_set_level(AV_LOG_INFO);
-        // av_dump_format(ifmt_ctx, 0, params.ifile, 0);
-        // av_log_set_level(AV_LOG_FATAL);
+        // keep the views of multi-stream inputs apart
+        if (nb_video > 1) {
+                snprintf(vs->map_prefix, len, "%s-%d", params->heatmap,
+                         vs->index);
+        } else {
+                snprintf(vs->map_prefix, len, "%s", params->heatmap);
+        }
 
-        ret = open_output_file(&ofmt_ctx, params.ofile);
-        if (ret < 0) {
-                goto cleanup;
+        return 0;
+}
+
+static int open_video_stream(struct video_stream *vs, AVFormatContext *ifmt,
+                             int index, struct parameters *params) {
+        vs->index = index;
+        vs->ifmt_ctx = ifmt;
+        vs->last_pts = AV_NOPTS_VALUE;
+        vs->skip_pts = AV_NOPTS_VALUE;
+        vs->drain_decoder = 1;
+
+        vs->q = init_queue(params->delay);
+        vs->packets = init_packet_queue(PACKET_QUEUE_SIZE);
+        vs->blender = init_blender(params->profile.blend_kernel,
+                                   params->profile.blend_threads);
+        if (vs->q == NULL || vs->packets == NULL || vs->blender == NULL) {
+                return AVERROR(ENOMEM);
         }
 
-        ret = create_output_streams(ifmt_ctx, ofmt_ctx, &video_stream);
-        if (ret < 0) {
-                goto cleanup;
+        if (params->keyframes_only) {
+                // the time-lapse plays the kept frames at the input rate
+                AVRational rate =
+                    av_guess_frame_rate(ifmt, ifmt->streams[index], NULL);
+                if (rate.num <= 0 || rate.den <= 0) {
+                        rate = (AVRational){25, 1};
+                }
+                vs->frame_duration = av_rescale_q(
+                    1, av_inv_q(rate), ifmt->streams[index]->time_base);
+                if (vs->frame_duration <= 0) {
+                        vs->frame_duration = 1;
+                }
         }
 
-        ret = configure_decoder(ifmt_ctx, &decoder_ctx, video_stream);
-        if (ret < 0) {
-                goto cleanup;
+        return configure_decoder(ifmt, &vs->decoder_ctx, index,
+                                 params->keyframes_only,
+                                 params->profile.codec_threads);
+}
+
+static void close_video_stream(struct video_stream *vs) {
+        if (vs->q != NULL)
+                free_queue(vs->q);
+        free_packet_queue(vs->packets);
+        free_blender(&vs->blender);
+        free_motion_map(&vs->map);
+        free(vs->map_prefix);
+        avcodec_free_context(&vs->decoder_ctx);
+        avcodec_free_context(&vs->encoder_ctx);
+}
+
+static struct video_stream *find_video_stream(struct video_stream *streams,
+                                              int nb_video, int index) {
+        for (int i = 0; i < nb_video; i++) {
+                if (streams[i].index == index) {
+                        return &streams[i];
+                }
         }
+        return NULL;
+}
 
-        ret = configure_encoder(ifmt_ctx, ofmt_ctx, &encoder_ctx, decoder_ctx,
-                                video_stream);
-        if (ret < 0) {
-                goto cleanup;
+static int start_workers(struct video_stream *streams, int nb_video) {
+        for (int i = 0; i < nb_video; i++) {
+                streams[i].ret = 0;
+                int ret = pthread_create(&streams[i].thread, NULL,
+                                         process_stream, &streams[i]);
+                if (ret != 0) {
+                        fprintf(stderr,
+                                "ERROR:   Failed to start stream thread\n");
+                        return AVERROR(ret);
+                }
+                streams[i].running = 1;
         }
+        return 0;
+}
 
-        // av_log_set_level(AV_LOG_INFO);
-        // av_dump_format(ofmt_ctx, 0, params.ofile, 1);
-        // av_log_set_level(AV_LOG_FATAL);
+/* With flush set, every worker drains its stream before exiting, otherwise
+ * they're told to give up. Returns the first error any worker hit. */
+static int stop_workers(struct video_stream *streams, int nb_video,
+                        int flush) {
+        int ret = 0;
 
-        ret = avformat_write_header(ofmt_ctx, NULL);
-        if (ret < 0) {
-                fprintf(stderr,
-                        "ERROR:   Failed to write header to the output file\n");
-                goto cleanup;
+        for (int i = 0; i < nb_video; i++) {
+                if (!streams[i].running) {
+                        continue;
+                }
+                if (flush) {
+                        put_packet(streams[i].packets, NULL);
+                } else {
+                        abort_packet_queue(streams[i].packets);
+                }
         }
 
-        packet = av_packet_alloc();
-        if (packet == NULL) {
-                fprintf(stderr, "ERROR:   Couldn't allocate packet\n");
-                goto cleanup;
+        for (int i = 0; i < nb_video; i++) {
+                if (!streams[i].running) {
+                        continue;
+                }
+                pthread_join(streams[i].thread, NULL);
+                streams[i].running = 0;
+                if (streams[i].ret < 0 && ret == 0) {
+                        ret = streams[i].ret;
+                }
         }
-        frame = av_frame_alloc();
-        if (frame == NULL) {
-                fprintf(stderr, "ERROR:   Couldn't allocate frame\n");
-                goto cleanup;
+
+        return ret;
+}
+
+/* Opens filename for the encoded streams and writes its header. With a
+ * segment format, the encoders are still set up for the real output. */
+static int open_job_output(struct job *job, const char *filename,
+                           const char *format) {
+        int ret = open_output_file(&job->ofmt_ctx, &job->output, filename,
+                                   format);
+        if (ret < 0) {
+                return ret;
         }
 
-        while (av_read_frame(ifmt_ctx, packet) >= 0) {
-                int stream_index = packet->stream_index;
+        ret = create_output_streams(job->ifmt_ctx, job->ofmt_ctx,
+                                    job->stream_map);
+        if (ret < 0) {
+                return ret;
+        }
 
-                if (ifmt_ctx->streams[stream_index]->codecpar->codec_type !=
-                    AVMEDIA_TYPE_VIDEO) {
-                        ret = mux(ifmt_ctx, ofmt_ctx, packet);
-                        if (ret < 0) {
-                                goto cleanup;
-                        }
-                } else {
-                        ret = avcodec_send_packet(decoder_ctx, packet);
-                        if (ret < 0) {
-                                fprintf(stderr, "ERROR:   Failed sending "
-                                                "packet to decoder\n");
-                                goto cleanup;
-                        }
-                        ret = recieve_frames(decoder_ctx, encoder_ctx, &frame,
-                                             q, packet, ifmt_ctx, ofmt_ctx);
-                        if (ret < 0) {
-                                goto cleanup;
+        const AVOutputFormat *container = job->ofmt_ctx->oformat;
+        if (job->seg != NULL) {
+                container = job->seg->container;
+                // keep input timestamps exact until the segments are joined
+                for (unsigned int i = 0; i < job->ifmt_ctx->nb_streams; i++) {
+                        if (job->stream_map[i] < 0) {
+                                continue;
                         }
+                        job->ofmt_ctx->streams[job->stream_map[i]]->time_base =
+                            job->ifmt_ctx->streams[i]->time_base;
                 }
+        }
 
-                av_packet_unref(packet);
+        for (int i = 0; i < job->nb_video; i++) {
+                struct video_stream *vs = &job->streams[i];
+                vs->out_index = job->stream_map[vs->index];
+                avcodec_free_context(&vs->encoder_ctx);
+                ret = configure_encoder(job->ifmt_ctx, job->ofmt_ctx, container,
+                                        &vs->encoder_ctx, vs->decoder_ctx,
+                                        vs->index, vs->out_index,
+                                        job->codec_threads);
+                if (ret < 0) {
+                        return ret;
+                }
+                vs->ofmt_ctx = job->ofmt_ctx;
         }
 
-        ret = avcodec_send_packet(decoder_ctx, NULL);
+        // av_log_set_level(AV_LOG_INFO);
+        // av_dump_format(job->ofmt_ctx, 0, filename, 1);
+        // av_log_set_level(AV_LOG_FATAL);
+
+        ret = avformat_write_header(job->ofmt_ctx, NULL);
         if (ret < 0) {
-                fprintf(stderr, "ERROR:   Failed to flush decoder\n");
-                goto cleanup;
+                fprintf(stderr,
+                        "ERROR:   Failed to write header to the output file\n");
+                return ret;
         }
-        ret = recieve_frames(decoder_ctx, encoder_ctx, &frame, q, packet,
-                             ifmt_ctx, ofmt_ctx);
-        if (ret < 0)
-                goto cleanup;
 
-        ret = avcodec_send_frame(encoder_ctx, NULL);
+        return 0;
+}
+
+/* Drains every stream into the current output and closes it */
+/* sync is set for checkpoint segments, which have to be on disk before the
+ * state file that counts them is */
+static int finish_job_output(struct job *job, int sync) {
+        int ret = stop_workers(job->streams, job->nb_video, 1);
         if (ret < 0) {
-                fprintf(stderr, "ERROR:   Failed to flush encoder\n");
-                goto cleanup;
+                return ret;
         }
-        ret = recieve_packets(encoder_ctx, packet, ifmt_ctx, ofmt_ctx);
-        if (ret < 0)
-                goto cleanup;
 
-        ret = av_write_trailer(ofmt_ctx);
+        ret = av_write_trailer(job->ofmt_ctx);
         if (ret < 0) {
                 fprintf(stderr,
                         "ERROR:   Couldn't wirte output file trailer\n");
-                goto cleanup;
+                return ret;
         }
 
-        int perc = 100;
-        printf("\033[1A\33[2K\rProgress: %02d%%   ", perc);
+        return close_output_file(&job->ofmt_ctx, &job->output, sync);
+}
 
-        int us = duration * time_base.num % time_base.den;
-        int secs = duration * time_base.num / time_base.den % 60;
-        int mins = duration * time_base.num / time_base.den / 60 % 60;
-        int hours = duration * time_base.num / time_base.den / 3600;
-        printf("Time: %02d:%02d:%02d.%02d\n", hours, mins, secs,
-               (100 * us * time_base.num) / time_base.den);
+static int dispatch_packet(struct job *job, AVPacket *packet) {
+        int index = packet->stream_index;
+        if (job->stream_map[index] < 0) {
+                return 0;
+        }
 
-cleanup:
-        av_packet_free(&packet);
-        av_frame_free(&frame);
-        free_queue(q);
-        avcodec_free_context(&decoder_ctx);
-        avcodec_free_context(&encoder_ctx);
-        if (ofmt_ctx && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE))
-                avio_closep(&ofmt_ctx->pb);
-        avformat_free_context(ofmt_ctx);
-        avformat_close_input(&ifmt_ctx);
+        // reported here, output timestamps don't follow the input with
+        // --keyframes-only
+        print_report(packet->pts);
+
+        struct video_stream *vs =
+            find_video_stream(job->streams, job->nb_video, index);
+        if (vs == NULL) {
+                return mux(job->ifmt_ctx, job->ofmt_ctx, packet,
+                           job->stream_map[index]);
+        }
+
+        // not every demuxer honours AVDISCARD_NONKEY, don't decode them
+        if (job->keyframes_only && !(packet->flags & AV_PKT_FLAG_KEY)) {
+                return 0;
+        }
+
+        AVPacket *video_packet = av_packet_alloc();
+        if (video_packet == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't allocate packet\n");
+                return AVERROR(ENOMEM);
+        }
+        av_packet_move_ref(video_packet, packet);
+
+        // only fails once the stream's worker has given up
+        return put_packet(vs->packets, video_packet);
+}
+
+static const char *segment_name(struct segmenter *seg, int n) {
+        snprintf(seg->segment_file, seg->name_len, "%s.%04d.seg", seg->ofile,
+                 n);
+        return seg->segment_file;
+}
+
+/* The job keeps the blend and codec settings it was started with, even if
+ * the host profile changed since. Nothing has been decoded yet, so the
+ * blenders and decoders can simply be set up again. */
+static int restore_tuning(struct job *job, struct parameters *params,
+                          const struct checkpoint *state) {
+        struct profile *p = &params->profile;
+        if (state->blend_kernel < 0 || state->blend_kernel >= NB_BLEND_KERNELS ||
+            state->blend_threads < 1 || state->codec_threads < 0) {
+                fprintf(stderr, "ERROR:   Checkpoint has invalid tuning "
+                                "settings\n");
+                return AVERROR_INVALIDDATA;
+        }
+        if ((int)p->blend_kernel == state->blend_kernel &&
+            p->blend_threads == state->blend_threads &&
+            p->codec_threads == state->codec_threads) {
+                return 0;
+        }
+
+        printf("  Using the checkpoint's settings: %s blend kernel on %d "
+               "threads, %d codec threads\n",
+               blend_kernel_names[state->blend_kernel], state->blend_threads,
+               state->codec_threads);
+        p->blend_kernel = state->blend_kernel;
+        p->blend_threads = state->blend_threads;
+        p->codec_threads = state->codec_threads;
+        job->codec_threads = p->codec_threads;
+
+        for (int i = 0; i < job->nb_video; i++) {
+                struct video_stream *vs = &job->streams[i];
+                free_blender(&vs->blender);
+                vs->blender = init_blender(p->blend_kernel, p->blend_threads);
+                if (vs->blender == NULL) {
+                        return AVERROR(ENOMEM);
+                }
+                avcodec_free_context(&vs->decoder_ctx);
+                int ret = configure_decoder(job->ifmt_ctx, &vs->decoder_ctx,
+                                            vs->index, params->keyframes_only,
+                                            p->codec_threads);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
+
+        return 0;
+}
+
+static int init_segmenter(struct segmenter *seg, struct job *job,
+                          struct parameters *params) {
+        seg->ofile = params->ofile;
+        seg->container = av_guess_format(NULL, params->ofile, NULL);
+        if (seg->container == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't deduce the output format "
+                                "from '%s'\n",
+                        params->ofile);
+                return -1;
+        }
+
+        unsigned int nb_streams = job->ifmt_ctx->nb_streams;
+        seg->name_len = strlen(params->ofile) + 32;
+        seg->state_file = malloc(seg->name_len);
+        seg->segment_file = malloc(seg->name_len);
+        seg->queues = malloc(job->nb_video * sizeof(*seg->queues));
+        seg->maps = malloc(job->nb_video * sizeof(*seg->maps));
+        seg->reached = calloc(nb_streams, sizeof(*seg->reached));
+        seg->resyncing = calloc(nb_streams, sizeof(*seg->resyncing));
+        seg->idle = calloc(nb_streams, sizeof(*seg->idle));
+        seg->last_seen = malloc(nb_streams * sizeof(*seg->last_seen));
+        seg->key_dts = malloc(nb_streams * sizeof(*seg->key_dts));
+        if (seg->state_file == NULL || seg->segment_file == NULL ||
+            seg->queues == NULL || seg->maps == NULL || seg->reached == NULL ||
+            seg->resyncing == NULL || seg->idle == NULL ||
+            seg->last_seen == NULL || seg->key_dts == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't allocate checkpoint "
+                                "state\n");
+                return AVERROR(ENOMEM);
+        }
+        snprintf(seg->state_file, seg->name_len, "%s.ckpt", params->ofile);
+        for (unsigned int i = 0; i < nb_streams; i++) {
+                seg->last_seen[i] = AV_NOPTS_VALUE;
+                seg->key_dts[i] = AV_NOPTS_VALUE;
+        }
+
+        for (int i = 0; i < job->nb_video; i++) {
+                seg->queues[i] = job->streams[i].q;
+                seg->maps[i] = job->streams[i].map;
+        }
+
+        int ret = init_checkpoint(&seg->state, nb_streams, job->nb_video);
+        if (ret < 0) {
+                return ret;
+        }
+        seg->state.delay = params->delay;
+        seg->state.keyframes_only = params->keyframes_only;
+        seg->state.interval = params->checkpoint;
+        seg->state.blend_kernel = params->profile.blend_kernel;
+        seg->state.blend_threads = params->profile.blend_threads;
+        seg->state.codec_threads = params->profile.codec_threads;
+        seg->state.input_size = avio_size(job->ifmt_ctx->pb);
+        seg->state.input_duration = job->ifmt_ctx->duration;
+
+        if (!params->resume) {
+                // a crash before our first checkpoint mustn't let --resume
+                // pick up the previous job's state
+                if (remove(seg->state_file) == 0) {
+                        int n = 0;
+                        while (remove(segment_name(seg, n)) == 0) {
+                                n++;
+                        }
+                }
+                return 0;
+        }
+
+        ret = load_checkpoint(seg->state_file, &seg->state, seg->queues,
+                              seg->maps, job->nb_video);
+        if (ret == AVERROR(ENOENT)) {
+                printf("\033[93mWarning! \033[0mNo checkpoint found, "
+                       "starting from the beginning.\n");
+                ret = 0;
+        } else if (ret == 0) {
+                printf("  Resuming from segment %d\n", seg->state.segment);
+                ret = restore_tuning(job, params, &seg->state);
+                if (ret < 0) {
+                        return ret;
+                }
+                for (int i = 0; i < job->nb_video; i++) {
+                        job->streams[i].frames = seg->state.frames[i];
+                        job->streams[i].skip_pts = seg->state.skip_pts[i];
+                        job->streams[i].last_pts = seg->state.skip_pts[i];
+                        // decoding starts over at this keyframe
+                        seg->key_dts[job->streams[i].index] =
+                            seg->state.replay_dts[i];
+                }
+                for (unsigned int i = 0; i < nb_streams; i++) {
+                        seg->resyncing[i] = 1;
+                }
+        }
+
+        return ret;
+}
+
+static void free_segmenter(struct segmenter *seg) {
+        for (int i = 0; i < seg->nb_held; i++) {
+                av_packet_free(&seg->held[i]);
+        }
+        free(seg->held);
+        free(seg->reached);
+        free(seg->resyncing);
+        free(seg->idle);
+        free(seg->last_seen);
+        free(seg->key_dts);
+        free(seg->queues);
+        free(seg->maps);
+        free(seg->segment_file);
+        free(seg->state_file);
+        free_checkpoint(&seg->state);
+}
+
+/* Seeks to a point before every stream's last packet that already made it
+ * into a finished segment, or the keyframe an idle video stream has to be
+ * decoded from again. handle_packet() drops anything before those. */
+static void seek_to_checkpoint(struct job *job) {
+        struct checkpoint *state = &job->seg->state;
+        int64_t ts = INT64_MAX;
+
+        for (unsigned int i = 0; i < state->nb_streams; i++) {
+                if (job->ifmt_ctx->streams[i]->discard == AVDISCARD_ALL) {
+                        continue;
+                }
+                int64_t dts = state->last_dts[i];
+                if (job->seg->key_dts[i] != AV_NOPTS_VALUE) {
+                        dts = job->seg->key_dts[i];
+                }
+                // a stream that hasn't started yet, read from the start
+                if (dts == AV_NOPTS_VALUE) {
+                        return;
+                }
+                ts = FFMIN(ts, av_rescale_q(dts,
+                                            job->ifmt_ctx->streams[i]->time_base,
+                                            AV_TIME_BASE_Q));
+        }
+
+        int ret = avformat_seek_file(job->ifmt_ctx, -1, INT64_MIN, ts, ts, 0);
+        if (ret < 0) {
+                printf("\033[93mWarning! \033[0mInput isn't seekable, "
+                       "skipping to the checkpoint by reading it.\n");
+        }
+}
+
+static int hold_packet(struct segmenter *seg, AVPacket *packet) {
+        if (seg->nb_held == seg->held_cap) {
+                int cap = seg->held_cap ? seg->held_cap * 2 : 64;
+                AVPacket **held = realloc(seg->held, cap * sizeof(*held));
+                if (held == NULL) {
+                        fprintf(stderr, "ERROR:   Couldn't allocate packet\n");
+                        return AVERROR(ENOMEM);
+                }
+                seg->held = held;
+                seg->held_cap = cap;
+        }
+
+        AVPacket *copy = av_packet_alloc();
+        if (copy == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't allocate packet\n");
+                return AVERROR(ENOMEM);
+        }
+        av_packet_move_ref(copy, packet);
+        seg->held[seg->nb_held++] = copy;
+
+        return 0;
+}
+
+/* Counts video streams that went quiet (ended, or a camera that stopped)
+ * as having reached the checkpoint. They're not waiting at a keyframe, so
+ * their decoders are carried over into the next segment as they are. */
+static void mark_idle_streams(struct job *job, int64_t now) {
+        struct segmenter *seg = job->seg;
+
+        for (int i = 0; i < job->nb_video; i++) {
+                int index = job->streams[i].index;
+                int64_t seen = FFMAX(seg->last_seen[index], seg->pending_ts);
+                if (seg->reached[index] ||
+                    now - seen < (int64_t)STREAM_IDLE_TIME * AV_TIME_BASE) {
+                        continue;
+                }
+                seg->reached[index] = 1;
+                seg->nb_reached++;
+                seg->idle[index] = 1;
+        }
+}
+
+/* Too much was held back waiting for the streams to line up: puts the held
+ * packets into the current segment and tries again at the next interval. */
+static int skip_checkpoint(struct job *job, int64_t now) {
+        struct segmenter *seg = job->seg;
+        int ret = 0;
+
+        printf("\033[93mWarning! \033[0mThe video streams have no keyframes "
+               "close together, skipping a checkpoint.\n");
+
+        for (int i = 0; i < seg->nb_held; i++) {
+                AVPacket *packet = seg->held[i];
+                int64_t ts =
+                    packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+                if (ts != AV_NOPTS_VALUE) {
+                        seg->state.last_dts[packet->stream_index] = ts;
+                        if (packet->flags & AV_PKT_FLAG_KEY) {
+                                seg->key_dts[packet->stream_index] = ts;
+                        }
+                }
+                if (ret >= 0) {
+                        ret = dispatch_packet(job, packet);
+                }
+                av_packet_free(&seg->held[i]);
+        }
+        seg->nb_held = 0;
+
+        int64_t interval = (int64_t)seg->state.interval * AV_TIME_BASE;
+        while (seg->state.next_checkpoint <= now) {
+                seg->state.next_checkpoint += interval;
+        }
+        seg->pending = 0;
+        seg->nb_reached = 0;
+        memset(seg->reached, 0,
+               job->ifmt_ctx->nb_streams * sizeof(*seg->reached));
+        memset(seg->idle, 0, job->ifmt_ctx->nb_streams * sizeof(*seg->idle));
+
+        return ret;
+}
+
+/* Returns 1 once every video stream is waiting at a keyframe (or has gone
+ * idle) and the segment can be closed with take_checkpoint(). */
+static int handle_packet(struct job *job, AVPacket *packet) {
+        struct segmenter *seg = job->seg;
+        if (seg == NULL) {
+                return dispatch_packet(job, packet);
+        }
+
+        int index = packet->stream_index;
+        AVRational tb = job->ifmt_ctx->streams[index]->time_base;
+        int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+        int64_t last = seg->state.last_dts[index];
+        struct video_stream *vs =
+            find_video_stream(job->streams, job->nb_video, index);
+
+        if (seg->resyncing[index]) {
+                int64_t replay = seg->key_dts[index];
+                if (vs != NULL && replay != AV_NOPTS_VALUE) {
+                        // an idle stream is decoded again from its keyframe
+                        if (ts != AV_NOPTS_VALUE && ts < replay) {
+                                return 0;
+                        }
+                } else if (ts != AV_NOPTS_VALUE && last != AV_NOPTS_VALUE &&
+                           ts <= last) {
+                        return 0;
+                }
+                // the decoder starts from scratch
+                if (vs != NULL && !(packet->flags & AV_PKT_FLAG_KEY)) {
+                        return 0;
+                }
+                seg->resyncing[index] = 0;
+        }
+
+        int64_t now = AV_NOPTS_VALUE;
+        if (ts != AV_NOPTS_VALUE) {
+                now = av_rescale_q(ts, tb, AV_TIME_BASE_Q);
+                seg->last_seen[index] = now;
+                if (seg->state.next_checkpoint == AV_NOPTS_VALUE) {
+                        seg->state.next_checkpoint =
+                            now + (int64_t)seg->state.interval * AV_TIME_BASE;
+                }
+                if (!seg->pending && now >= seg->state.next_checkpoint) {
+                        seg->pending = 1;
+                        seg->pending_ts = now;
+                }
+        }
+
+        int ret;
+        if (seg->pending && vs != NULL &&
+            (seg->reached[index] || (packet->flags & AV_PKT_FLAG_KEY))) {
+                if (!seg->reached[index]) {
+                        seg->reached[index] = 1;
+                        seg->nb_reached++;
+                }
+                ret = hold_packet(seg, packet);
+        } else {
+                if (ts != AV_NOPTS_VALUE) {
+                        seg->state.last_dts[index] = ts;
+                        if (vs != NULL && (packet->flags & AV_PKT_FLAG_KEY)) {
+                                seg->key_dts[index] = ts;
+                        }
+                }
+                ret = dispatch_packet(job, packet);
+        }
+        if (ret < 0 || !seg->pending) {
+                return ret;
+        }
+
+        if (now != AV_NOPTS_VALUE) {
+                mark_idle_streams(job, now);
+        }
+        if (seg->nb_reached == job->nb_video) {
+                return 1;
+        }
+        if (seg->nb_held >= MAX_HELD_PACKETS) {
+                return skip_checkpoint(job, seg->pending_ts);
+        }
+
+        return 0;
+}
+
+/* Closes the current segment at the keyframes handle_packet() stopped at,
+ * saves the state and carries on in a new segment. */
+static int take_checkpoint(struct job *job) {
+        struct segmenter *seg = job->seg;
+
+        // draining an idle stream's decoder would lose the frames after it
+        // up to its next keyframe, so it keeps going. A resumed run gets
+        // there by decoding again from its last keyframe.
+        for (int i = 0; i < job->nb_video; i++) {
+                struct video_stream *vs = &job->streams[i];
+                vs->drain_decoder = !seg->idle[vs->index] ||
+                                    seg->key_dts[vs->index] == AV_NOPTS_VALUE;
+        }
+
+        int ret = finish_job_output(job, 1);
+        if (ret < 0) {
+                return ret;
+        }
+
+        int64_t interval = (int64_t)seg->state.interval * AV_TIME_BASE;
+        while (seg->state.next_checkpoint <= seg->pending_ts) {
+                seg->state.next_checkpoint += interval;
+        }
+        seg->state.segment++;
+        for (int i = 0; i < job->nb_video; i++) {
+                struct video_stream *vs = &job->streams[i];
+                seg->state.frames[i] = vs->frames;
+                seg->state.replay_dts[i] = AV_NOPTS_VALUE;
+                seg->state.skip_pts[i] = AV_NOPTS_VALUE;
+                if (!vs->drain_decoder) {
+                        seg->state.replay_dts[i] = seg->key_dts[vs->index];
+                        seg->state.skip_pts[i] = vs->last_pts;
+                }
+        }
+        seg->pending = 0;
+        seg->nb_reached = 0;
+        memset(seg->reached, 0,
+               job->ifmt_ctx->nb_streams * sizeof(*seg->reached));
+        memset(seg->idle, 0, job->ifmt_ctx->nb_streams * sizeof(*seg->idle));
+
+        ret = save_checkpoint(seg->state_file, &seg->state, seg->queues,
+                              seg->maps, job->nb_video);
+        if (ret < 0) {
+                return ret;
+        }
+
+        // drained decoders get held packets starting with a keyframe next
+        for (int i = 0; i < job->nb_video; i++) {
+                struct video_stream *vs = &job->streams[i];
+                if (vs->drain_decoder) {
+                        avcodec_flush_buffers(vs->decoder_ctx);
+                }
+                vs->drain_decoder = 1;
+        }
+
+        ret = open_job_output(job, segment_name(seg, seg->state.segment),
+                              SEGMENT_FORMAT);
+        if (ret < 0) {
+                return ret;
+        }
+
+        ret = start_workers(job->streams, job->nb_video);
+        if (ret < 0) {
+                return ret;
+        }
+
+        // replaying can hold packets for the next checkpoint again
+        AVPacket **held = seg->held;
+        int nb_held = seg->nb_held;
+        seg->held = NULL;
+        seg->nb_held = 0;
+        seg->held_cap = 0;
+
+        for (int i = 0; i < nb_held; i++) {
+                if (ret >= 0) {
+                        ret = handle_packet(job, held[i]);
+                }
+                if (ret == 1) {
+                        ret = take_checkpoint(job);
+                }
+                av_packet_free(&held[i]);
+        }
+        free(held);
+
+        return ret;
+}
+
+/* Called at the end of the input: whatever is still held back goes into
+ * the last segment. */
+static int release_held_packets(struct job *job) {
+        struct segmenter *seg = job->seg;
+        int ret = 0;
+
+        for (int i = 0; i < seg->nb_held; i++) {
+                if (ret >= 0) {
+                        ret = dispatch_packet(job, seg->held[i]);
+                }
+                av_packet_free(&seg->held[i]);
+        }
+        seg->nb_held = 0;
+
+        return ret;
+}
+
+/* Remuxes the finished segments, in order, into the real output file */
+static int join_segments(struct segmenter *seg) {
+        AVFormatContext *ofmt_ctx = NULL;
+        AVFormatContext *seg_ctx = NULL;
+        struct async_output *output = NULL;
+        struct mmap_input *input = NULL;
+
+        AVPacket *packet = av_packet_alloc();
+        if (packet == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't allocate packet\n");
+                return AVERROR(ENOMEM);
+        }
+
+        int ret = open_output_file(&ofmt_ctx, &output, seg->ofile, NULL);
+        if (ret < 0) {
+                goto cleanup;
+        }
+
+        for (int n = 0; n <= seg->state.segment; n++) {
+                ret = open_input_file(&seg_ctx, &input, segment_name(seg, n));
+                if (ret < 0) {
+                        goto cleanup;
+                }
+
+                if (n == 0) {
+                        for (unsigned int i = 0; i < seg_ctx->nb_streams; i++) {
+                                AVStream *stream =
+                                    avformat_new_stream(ofmt_ctx, NULL);
+                                if (stream == NULL ||
+                                    avcodec_parameters_copy(
+                                        stream->codecpar,
+                                        seg_ctx->streams[i]->codecpar) < 0) {
+                                        fprintf(stderr,
+                                                "ERROR:   Failed to add stream "
+                                                "to the output file\n");
+                                        ret = -1;
+                                        goto cleanup;
+                                }
+                                // the segment container's tag may not fit
+                                stream->codecpar->codec_tag = 0;
+                                stream->disposition =
+                                    seg_ctx->streams[i]->disposition;
+                                stream->time_base =
+                                    seg_ctx->streams[i]->time_base;
+                        }
+
+                        ret = avformat_write_header(ofmt_ctx, NULL);
+                        if (ret < 0) {
+                                fprintf(stderr, "ERROR:   Failed to write "
+                                                "header to the output file\n");
+                                goto cleanup;
+                        }
+                } else if (seg_ctx->nb_streams != ofmt_ctx->nb_streams) {
+                        fprintf(stderr, "ERROR:   Segment '%s' doesn't match "
+                                        "the others\n",
+                                seg->segment_file);
+                        ret = AVERROR_INVALIDDATA;
+                        goto cleanup;
+                }
+
+                while ((ret = av_read_frame(seg_ctx, packet)) >= 0) {
+                        int i = packet->stream_index;
+                        av_packet_rescale_ts(packet,
+                                             seg_ctx->streams[i]->time_base,
+                                             ofmt_ctx->streams[i]->time_base);
+                        ret = av_interleaved_write_frame(ofmt_ctx, packet);
+                        if (ret < 0) {
+                                fprintf(stderr, "ERROR:   Failed to write "
+                                                "packet to output file\n");
+                                goto cleanup;
+                        }
+                }
+                if (ret != AVERROR_EOF) {
+                        fprintf(stderr, "ERROR:   Failed reading segment "
+                                        "'%s'\n",
+                                seg->segment_file);
+                        goto cleanup;
+                }
+
+                avformat_close_input(&seg_ctx);
+                close_mmap_input(&input);
+        }
+
+        ret = av_write_trailer(ofmt_ctx);
+        if (ret < 0) {
+                fprintf(stderr,
+                        "ERROR:   Couldn't wirte output file trailer\n");
+                goto cleanup;
+        }
+
+        ret = close_output_file(&ofmt_ctx, &output, 0);
+        if (ret < 0) {
+                goto cleanup;
+        }
+
+        for (int n = 0; n <= seg->state.segment; n++) {
+                remove(segment_name(seg, n));
+        }
+        remove(seg->state_file);
+
+cleanup:
+        av_packet_free(&packet);
+        avformat_close_input(&seg_ctx);
+        close_mmap_input(&input);
+        if (ofmt_ctx != NULL)
+                close_output_file(&ofmt_ctx, &output, 0);
+
+        return ret;
+}
+
+/* --calibrate: benchmarks at the input's resolution and codec when one is
+ * given, otherwise at 1080p H.264, and saves the result for this host */
+static int run_calibration(struct parameters *params) {
+        int width = 1920;
+        int height = 1080;
+        enum AVCodecID codec_id = AV_CODEC_ID_H264;
+
+        if (params->ifile != NULL) {
+                AVFormatContext *ifmt = NULL;
+                struct mmap_input *input = NULL;
+                int ret = open_input_file(&ifmt, &input, params->ifile);
+                if (ret < 0) {
+                        avformat_close_input(&ifmt);
+                        close_mmap_input(&input);
+                        return ret;
+                }
+                ret = av_find_best_stream(ifmt, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                          NULL, 0);
+                if (ret >= 0) {
+                        AVCodecParameters *par = ifmt->streams[ret]->codecpar;
+                        width = par->width;
+                        height = par->height;
+                        codec_id = par->codec_id;
+                }
+                avformat_close_input(&ifmt);
+                close_mmap_input(&input);
+                if (ret < 0) {
+                        fprintf(stderr, "ERROR:   Input file doesn't contain "
+                                        "a video stream\n");
+                        return ret;
+                }
+        }
+
+        char *path = profile_path(width, height, codec_id);
+        if (path == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't find a place to save the "
+                                "profile, is $HOME set?\n");
+                return -1;
+        }
+
+        printf("\033[1mCalibrating...\033[0m\n");
+        struct profile profile;
+        int ret = calibrate(&profile, width, height, codec_id);
+        if (ret < 0) {
+                fprintf(stderr, "ERROR:   Calibration failed (error: %s)\n",
+                        av_err2str(ret));
+                free(path);
+                return ret;
+        }
+
+        ret = save_profile(path, &profile);
+        if (ret == 0) {
+                printf("\nUsing the %s blend kernel on %d threads and %d "
+                       "codec threads\n"
+                       "  Profile: %s\n",
+                       blend_kernel_names[profile.blend_kernel],
+                       profile.blend_threads, profile.codec_threads, path);
+        }
+        free(path);
+
+        return ret;
+}
+
+/* Loads the --calibrate profile for the input's main video stream, the
+ * defaults are used if this host was never calibrated for that size */
+static void load_host_profile(AVFormatContext *ifmt, struct profile *p) {
+        default_profile(p);
+
+        int video = av_find_best_stream(ifmt, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                        NULL, 0);
+        if (video < 0) {
+                return;
+        }
+        AVCodecParameters *par = ifmt->streams[video]->codecpar;
+
+        char *path = profile_path(par->width, par->height, par->codec_id);
+        if (path == NULL) {
+                return;
+        }
+
+        struct profile loaded;
+        default_profile(&loaded);
+        if (load_profile(path, &loaded) < 0) {
+                free(path);
+                return;
+        }
+
+        if (loaded.width != par->width || loaded.height != par->height ||
+            loaded.codec_id != par->codec_id) {
+                printf("\033[93mWarning! \033[0mProfile '%s' was calibrated "
+                       "for %dx%d %s, using the defaults\n",
+                       path, loaded.width, loaded.height,
+                       avcodec_get_name(loaded.codec_id));
+        } else {
+                (*p) = loaded;
+                printf("  Profile: %s\n", path);
+        }
+        free(path);
+}
+
+int main(int argc, char *argv[]) {
+        av_log_set_level(AV_LOG_QUIET);
+
+        struct parameters params = {.delay = 2};
+
+        int ret = parse_args(argc, argv, &params);
+        switch (ret) {
+        case 1:
+                return 0;
+        case 0:
+                break;
+        default:
+                return ret;
+        }
+
+        if (params.calibrate) {
+                return run_calibration(&params) < 0 ? 1 : 0;
+        }
+
+        // prompt for conformation if output file is being overwritten
+        // The video specified for output already exists, write over it?
+        // avio_check()?
+
+        struct job job = {0};
+        struct segmenter seg = {0};
+        AVPacket *packet = NULL;
+
+        ret = open_input_file(&job.ifmt_ctx, &job.input, params.ifile);
+        if (ret < 0) {
+                goto cleanup;
+        }
+
+        printf("\033[1mMotion Extracting...\033[0m\n"
+               "  Input Video: %s\n"
+               "  Output Video: %s\n",
+               params.ifile, params.ofile);
+        load_host_profile(job.ifmt_ctx, &params.profile);
+        char *fr_msg = "";
+        if (params.delay == 0) {
+                fr_msg = "(Frozen)";
+        } else if (params.keyframes_only) {
+                fr_msg = "keyframes";
+        }
+        printf("  delay: %d %s\n\n", params.delay, fr_msg);
+
+        // av_log_set_level(AV_LOG_INFO);
+        // av_dump_format(job.ifmt_ctx, 0, params.ifile, 0);
+        // av_log_set_level(AV_LOG_FATAL);
+
+        job.keyframes_only = params.keyframes_only;
+        job.codec_threads = params.profile.codec_threads;
+        for (unsigned int i = 0; i < job.ifmt_ctx->nb_streams; i++) {
+                AVStream *stream = job.ifmt_ctx->streams[i];
+                if (is_extracted_stream(stream)) {
+                        job.nb_video++;
+                        if (job.keyframes_only)
+                                stream->discard = AVDISCARD_NONKEY;
+                } else if (job.keyframes_only) {
+                        // audio and cover art make no sense in the time-lapse
+                        stream->discard = AVDISCARD_ALL;
+                }
+        }
+        if (job.nb_video == 0) {
+                fprintf(stderr, "ERROR:   Input file doesn't contain a video "
+                                "stream\n");
+                ret = -1;
+                goto cleanup;
+        }
+
+        job.streams = calloc(job.nb_video, sizeof(*job.streams));
+        job.stream_map =
+            malloc(job.ifmt_ctx->nb_streams * sizeof(*job.stream_map));
+        if (job.streams == NULL || job.stream_map == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't allocate streams\n");
+                ret = AVERROR(ENOMEM);
+                goto cleanup;
+        }
+
+        for (unsigned int i = 0, n = 0; i < job.ifmt_ctx->nb_streams; i++) {
+                if (!is_extracted_stream(job.ifmt_ctx->streams[i])) {
+                        continue;
+                }
+                struct video_stream *vs = &job.streams[n++];
+                ret = open_video_stream(vs, job.ifmt_ctx, i, &params);
+                if (ret < 0) {
+                        goto cleanup;
+                }
+                if (params.heatmap != NULL) {
+                        ret = open_motion_map(vs, &params, job.nb_video);
+                        if (ret < 0) {
+                                goto cleanup;
+                        }
+                }
+        }
+
+        if (params.checkpoint > 0 || params.resume) {
+                job.seg = &seg;
+                ret = init_segmenter(&seg, &job, &params);
+                if (ret < 0) {
+                        goto cleanup;
+                }
+                if (seg.state.interval <= 0) {
+                        fprintf(stderr, "ERROR:   --resume without a saved "
+                                        "checkpoint needs --checkpoint\n");
+                        ret = -1;
+                        goto cleanup;
+                }
+                seek_to_checkpoint(&job);
+
+                ret = open_job_output(&job,
+                                      segment_name(&seg, seg.state.segment),
+                                      SEGMENT_FORMAT);
+        } else {
+                ret = open_job_output(&job, params.ofile, NULL);
+        }
+        if (ret < 0) {
+                goto cleanup;
+        }
+
+        packet = av_packet_alloc();
+        if (packet == NULL) {
+                fprintf(stderr, "ERROR:   Couldn't allocate packet\n");
+                goto cleanup;
+        }
+
+        ret = start_workers(job.streams, job.nb_video);
+        if (ret < 0) {
+                goto cleanup;
+        }
+
+        while (av_read_frame(job.ifmt_ctx, packet) >= 0) {
+                ret = handle_packet(&job, packet);
+                av_packet_unref(packet);
+                if (ret == 1) {
+                        ret = take_checkpoint(&job);
+                }
+                if (ret == AVERROR_EXIT) {
+                        // a stream's worker failed, report why
+                        ret = stop_workers(job.streams, job.nb_video, 0);
+                }
+                if (ret < 0) {
+                        goto cleanup;
+                }
+        }
+
+        if (job.seg != NULL) {
+                ret = release_held_packets(&job);
+                if (ret < 0) {
+                        goto cleanup;
+                }
+        }
+
+        ret = finish_job_output(&job, 0);
+        if (ret < 0) {
+                goto cleanup;
+        }
+
+        if (job.seg != NULL) {
+                ret = join_segments(&seg);
+                if (ret < 0) {
+                        goto cleanup;
+                }
+        }
+
+        for (int i = 0; i < job.nb_video; i++) {
+                if (job.streams[i].map == NULL) {
+                        continue;
+                }
+                ret = write_motion_map(job.streams[i].map,
+                                       job.streams[i].map_prefix);
+                if (ret < 0) {
+                        goto cleanup;
+                }
+        }
+
+        int perc = 100;
+        printf("\033[1A\33[2K\rProgress: %02d%%   ", perc);
+
+        int us = duration * time_base.num % time_base.den;
+        int secs = duration * time_base.num / time_base.den % 60;
+        int mins = duration * time_base.num / time_base.den / 60 % 60;
+        int hours = duration * time_base.num / time_base.den / 3600;
+        printf("Time: %02d:%02d:%02d.%02d\n", hours, mins, secs,
+               (100 * us * time_base.num) / time_base.den);
+
+cleanup:
+        av_packet_free(&packet);
+        if (job.streams != NULL) {
+                stop_workers(job.streams, job.nb_video, 0);
+                for (int i = 0; i < job.nb_video; i++) {
+                        close_video_stream(&job.streams[i]);
+                }
+                free(job.streams);
+        }
+        free(job.stream_map);
+        if (job.ofmt_ctx != NULL)
+                close_output_file(&job.ofmt_ctx, &job.output, 0);
+        avformat_close_input(&job.ifmt_ctx);
+        close_mmap_input(&job.input);
+        if (job.seg != NULL)
+                free_segmenter(&seg);
 
         return ret;
 }
@@ -0,0 +1,87 @@
+#include "packet_queue.h"
+
+struct packet_queue *init_packet_queue(int cap) {
+        struct packet_queue *q = malloc(sizeof(*q));
+        if (q == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate packet queue\n");
+                return q;
+        }
+
+        q->packets = malloc(cap * sizeof(*q->packets));
+        if (q->packets == NULL) {
+                fprintf(stderr, "ERROR:   Failed to allocate packet queue\n");
+                free(q);
+                return NULL;
+        }
+
+        q->cap = cap;
+        q->head = 0;
+        q->size = 0;
+        q->aborted = 0;
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->cond, NULL);
+
+        return q;
+}
+
+void free_packet_queue(struct packet_queue *q) {
+        if (q == NULL) {
+                return;
+        }
+
+        for (int i = 0; i < q->size; i++) {
+                av_packet_free(&q->packets[(q->head + i) % q->cap]);
+        }
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->cond);
+        free(q->packets);
+        free(q);
+}
+
+/* Takes ownership of packet. Blocks while the queue is full. */
+int put_packet(struct packet_queue *q, AVPacket *packet) {
+        pthread_mutex_lock(&q->lock);
+        while (q->size == q->cap && !q->aborted) {
+                pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if (q->aborted) {
+                pthread_mutex_unlock(&q->lock);
+                av_packet_free(&packet);
+                return AVERROR_EXIT;
+        }
+
+        q->packets[(q->head + q->size) % q->cap] = packet;
+        q->size += 1;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+
+        return 0;
+}
+
+/* Blocks until a packet is available. The caller owns the returned packet. */
+int get_packet(struct packet_queue *q, AVPacket **packet) {
+        pthread_mutex_lock(&q->lock);
+        while (q->size == 0 && !q->aborted) {
+                pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if (q->aborted) {
+                pthread_mutex_unlock(&q->lock);
+                return AVERROR_EXIT;
+        }
+
+        (*packet) = q->packets[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->size -= 1;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+
+        return 0;
+}
+
+/* Wakes up both sides and makes every further put/get fail */
+void abort_packet_queue(struct packet_queue *q) {
+        pthread_mutex_lock(&q->lock);
+        q->aborted = 1;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,31 @@
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+
+#include <libavcodec/avcodec.h>
+#include <pthread.h>
+
+/*
+ * Bounded FIFO for handing demuxed packets to a stream's worker thread.
+ * A NULL packet marks the end of the stream.
+ */
+struct packet_queue {
+        AVPacket **packets;
+        int cap;
+        int head;
+        int size;
+        int aborted;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+};
+
+struct packet_queue *init_packet_queue(int cap);
+
+void free_packet_queue(struct packet_queue *q);
+
+int put_packet(struct packet_queue *q, AVPacket *packet);
+
+int get_packet(struct packet_queue *q, AVPacket **packet);
+
+void abort_packet_queue(struct packet_queue *q);
+
+#endif /* PACKET_QUEUE_H */
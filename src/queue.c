@@ -87,4 +87,28 @@ AVFrame *push_pop_queue(struct frame_queue *q,  AVFrame *frame) {
         free_node(prev_tail);
 
         return res;
+}
+
+/* Adds frame as the newest entry without handing anything back, used to
+ * rebuild a queue from a checkpoint. Fails if the queue is already full. */
+int append_queue(struct frame_queue *q, AVFrame *frame) {
+        if (q->size >= q->cap && !(q->cap == 0 && q->size == 0)) {
+                return -1;
+        }
+
+        struct queue_node *node = create_node(frame);
+        if (node == NULL) {
+                return -1;
+        }
+
+        if (q->head == NULL) {
+                q->tail = node;
+        } else {
+                node->next = q->head;
+                q->head->prev = node;
+        }
+        q->head = node;
+        q->size += 1;
+
+        return 0;
 }
\ No newline at end of file
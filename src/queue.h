@@ -23,4 +23,6 @@ void free_queue(struct frame_queue *q);
 
 AVFrame *push_pop_queue(struct frame_queue *q, AVFrame *frame);
 
+int append_queue(struct frame_queue *q, AVFrame *frame);
+
 #endif /* QUEUE_H */
\ No newline at end of file